@@ -1,11 +1,29 @@
+#pragma once
 #include <async-sockets/tcpsocket.hpp>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <assert.h>
 #include <format>
 #include <utility>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <string>
+#include <vector>
 #include <magic_enum_all.hpp>
+#include "shm.hpp"
+#include "capture.hpp"
+#include "fanout.hpp"
 /* ** API specification **
  *  The magic byte(s) encode
  *     1. The fundamental logic for API communication
@@ -18,6 +36,20 @@
  *
  *  A message is all the bytes following the ML. It has to be encodable by the MLENGTH.
  *  For example if MLENGTH is unsigned short, then the MAX_MESSAGE_LENGTH is 65535.
+ *
+ *  Two framings exist, both sides have to agree on one (see frameMode):
+ *     FIXED   ML is a 2 byte unsigned short, the original layout
+ *     VARINT  ML is LEB128 encoded, 1 byte up to 127, 2 bytes up to 16383, 3 bytes up to VARINT_MAX_MESSAGE_LENGTH
+ *
+ *  Capabilities are negotiated with HELLO [version][feature bits, 4 bytes little endian]:
+ *     1. The frontend sends HELLO with everything it supports, in the framing it started delta with.
+ *        It must not send anything else until the answer arrives.
+ *     2. delta answers with HELLO carrying the intersection, still in the old framing, and switches right after.
+ *     3. The frontend switches when it reads the answer.
+ *  Bits a side does not know are dropped by the intersection, so either side can be upgraded first.
+ *  A frontend that never sends HELLO gets the old behaviour. An old delta rejects HELLO with a LOG_ERROR,
+ *  frontends should treat that (or no answer) as "no features".
+ *  In daemon mode only the asking client gets the answer, it reports the shared stream as it is (see fanout.hpp).
  */
 #define LOG_FILENO STDOUT_FILENO
 #define API_IN_FILENO STDIN_FILENO
@@ -27,6 +59,8 @@
 #define MagicType unsigned char
 // 2 Bytes, encodes message length up to 65535 bytes = 64 KB
 #define MessageLengthType unsigned short
+// In memory frame lengths, wide enough for the varint framing
+#define FrameLengthType unsigned int
 
 #define MAX_VAL(TYPE) (TYPE) ~0
 
@@ -39,6 +73,22 @@ namespace Api
     const int MAX_FULL_MESSAGE_SIZE = MAX_MESSAGE_LENGTH + PREFIX_SIZE;
     const int MAX_PRE_MESSAGE_LENGTH = MAX_MESSAGE_LENGTH * 4;
 
+    const char VARINT_MAX_SIZE = 3;
+    const FrameLengthType VARINT_MAX_MESSAGE_LENGTH = (1 << (7 * VARINT_MAX_SIZE)) - 1; // 2 MB
+    const char MAX_PREFIX_SIZE = MAGIC_TYPE_SIZE + VARINT_MAX_SIZE;
+
+    enum FrameMode : unsigned char
+    {
+        FIXED,
+        VARINT
+    };
+    inline FrameMode frameMode = FIXED;
+
+    // Limits of the framing currently in use, prefer these over the MAX_* constants at runtime
+    inline FrameLengthType max_message_length() { return frameMode == VARINT ? VARINT_MAX_MESSAGE_LENGTH : MAX_MESSAGE_LENGTH; }
+    inline int max_prefix_size() { return frameMode == VARINT ? MAX_PREFIX_SIZE : PREFIX_SIZE; }
+    inline int max_full_message_size() { return max_message_length() + max_prefix_size(); }
+
     enum Magic : MagicType
     {
         DISCONNECT = MAX_VAL(MagicType),
@@ -50,7 +100,32 @@ namespace Api
         LOG_INFO = ACCEPT_CONNECT - 1,
         LOG_ERROR = LOG_INFO - 1,
 
-        MAX_CONNECTIONS = LOG_ERROR - 1
+        // Payload is [connId][chunk], the message continues in the next FRAGMENT or ends with a regular frame to connId
+        FRAGMENT = LOG_ERROR - 1,
+
+        // Binary logging, see log.hpp
+        LOG_FORMAT = FRAGMENT - 1,
+        LOG_RECORD = LOG_FORMAT - 1,
+        LOG_LEVEL = LOG_RECORD - 1, // Client sets the minimum log level, carried in the length
+
+        HELLO = LOG_LEVEL - 1, // Capabilities, see the top of the file
+
+        // Flow control, see FlowControl
+        CREDIT = HELLO - 1, // Client grants [bytes u32]
+        FLOW_STATE = CREDIT - 1,
+
+        // Payload is [bitmap of connIds, CONNECTION_BITMAP_SIZE bytes][message], the message goes to every set bit
+        SEND_MANY = FLOW_STATE - 1,
+
+        ATTACH = SEND_MANY - 1, // [u64 sequence], daemon mode only, see fanout.hpp
+
+        // [connId][u64 length], the payload is a descriptor passed along with this frame, see send_fd_frame
+        SEND_FD = ATTACH - 1,
+
+        // [connId][QueueState][queued u32][dropped u32], send queue of a peer crossed a watermark, see send_queue_state
+        SEND_QUEUE = SEND_FD - 1,
+
+        MAX_CONNECTIONS = SEND_QUEUE - 1
 
     };
 
@@ -60,19 +135,317 @@ namespace Api
         int len;
     } buffer;
 
-    void buffer_read_all(int fd, char *buf, int len)
+    typedef struct
     {
-        int m = read(fd, buf, len);
-        int d = len - m;
+        MagicType magic;
+        FrameLengthType length;   // Payload length, or connection number for special frames
+        const char *message;      // View into the decoder, valid until the next fill()
+    } frame;
+
+    // ** Protocol schema **
+    // Every magic has one descriptor. The decoder, the encoders (emit) and the dispatch table are generated
+    // from it, so nothing else should hardcode which frame carries what.
+    // Inbound is frontend -> delta, outbound is delta -> frontend. The direction matters,
+    // CONNECT carries "ip:port" from the client but a connection number from delta.
+    enum Direction : unsigned char
+    {
+        INBOUND,
+        OUTBOUND
+    };
+
+    enum FrameKind : unsigned char
+    {
+        INVALID, // Not allowed in this direction, rejected before any handler runs
+        DATA,    // Magic is the connection number, payload is the message
+        SPECIAL, // Length carries a connection number, there is no payload
+        PAYLOAD  // Control frame with a payload
+    };
+
+    enum FrameRole : unsigned char
+    {
+        ROLE_UNKNOWN,
+        ROLE_DATA,
+        ROLE_CONNECT,
+        ROLE_DISCONNECT,
+        ROLE_REQUEST_CONNECT,
+        ROLE_ACCEPT_CONNECT,
+        ROLE_LOG,
+        ROLE_LOG_LEVEL,
+        ROLE_FRAGMENT,
+        ROLE_HELLO,
+        ROLE_CREDIT,
+        ROLE_FLOW_STATE,
+        ROLE_SEND_MANY,
+        ROLE_ATTACH,
+        ROLE_SEND_FD,
+        ROLE_SEND_QUEUE
+    };
+
+    struct frame_descriptor
+    {
+        FrameRole role = ROLE_UNKNOWN;
+        FrameKind inbound = INVALID;
+        FrameKind outbound = INVALID;
+        bool control = false;                 // Flushed right away, never stuck behind bulk data
+        FrameLengthType minLength = 0;        // Of the payload, SPECIAL frames are checked against MAX_CONNECTIONS
+        bool (*valid)(const frame &) = nullptr; // Extra checks on the payload
+
+        constexpr FrameKind kind(Direction direction) const { return direction == INBOUND ? inbound : outbound; }
+    };
+
+    const int CONNECTION_BITMAP_SIZE = 32; // One bit per possible connId
+    const int PASS_FDS_MAX = 16;           // Descriptors taken from one recvmsg
+    const size_t PASS_FDS_QUEUED = 64;     // Received ahead of their SEND_FD frames, more is a protocol error
+
+    constexpr frame_descriptor describe(MagicType magic)
+    {
+        if (magic < Magic::MAX_CONNECTIONS)
+            return {ROLE_DATA, DATA, DATA};
+        switch (magic)
+        {
+        case Magic::CONNECT: // "ip:port", several targets are separated by '\n'
+            return {ROLE_CONNECT, PAYLOAD, SPECIAL, true, 3, [](const frame &f)
+                    { return memchr(f.message, ':', f.length) != nullptr; }};
+        case Magic::DISCONNECT:
+            return {ROLE_DISCONNECT, SPECIAL, SPECIAL, true};
+        case Magic::REQUEST_CONNECT:
+            return {ROLE_REQUEST_CONNECT, INVALID, SPECIAL, true};
+        case Magic::ACCEPT_CONNECT:
+            return {ROLE_ACCEPT_CONNECT, SPECIAL, INVALID, true};
+        case Magic::LOG_INFO:
+        case Magic::LOG_ERROR:
+            return {ROLE_LOG, INVALID, PAYLOAD};
+        case Magic::LOG_FORMAT: // [id][format string]
+            return {ROLE_LOG, INVALID, PAYLOAD, false, sizeof(unsigned short)};
+        case Magic::LOG_RECORD: // [level][id][arguments]
+            return {ROLE_LOG, INVALID, PAYLOAD, false, MAGIC_TYPE_SIZE + sizeof(unsigned short)};
+        case Magic::LOG_LEVEL:
+            return {ROLE_LOG_LEVEL, SPECIAL, INVALID, true};
+        case Magic::FRAGMENT:
+            return {ROLE_FRAGMENT, PAYLOAD, PAYLOAD, false, MAGIC_TYPE_SIZE, [](const frame &f)
+                    { return (MagicType)f.message[0] < Magic::MAX_CONNECTIONS; }};
+        case Magic::HELLO: // [version][features], longer payloads are fine
+            return {ROLE_HELLO, PAYLOAD, PAYLOAD, true, 5};
+        case Magic::CREDIT:
+            return {ROLE_CREDIT, PAYLOAD, INVALID, true, sizeof(uint32_t)};
+        case Magic::FLOW_STATE:
+            return {ROLE_FLOW_STATE, INVALID, PAYLOAD, true, 2 + 2 * sizeof(uint32_t)};
+        case Magic::SEND_MANY:
+            return {ROLE_SEND_MANY, PAYLOAD, INVALID, false, CONNECTION_BITMAP_SIZE};
+        case Magic::ATTACH:
+            return {ROLE_ATTACH, PAYLOAD, PAYLOAD, true, sizeof(uint64_t)};
+        case Magic::SEND_FD:
+            return {ROLE_SEND_FD, PAYLOAD, INVALID, false, MAGIC_TYPE_SIZE + sizeof(uint64_t), [](const frame &f)
+                    { return (MagicType)f.message[0] < Magic::MAX_CONNECTIONS; }};
+        case Magic::SEND_QUEUE:
+            return {ROLE_SEND_QUEUE, INVALID, PAYLOAD, true, 2 + 2 * sizeof(uint32_t)};
+        }
+        return {};
+    }
+
+    constexpr std::array<frame_descriptor, 1 << (8 * sizeof(MagicType))> SCHEMA = []
+    {
+        std::array<frame_descriptor, 1 << (8 * sizeof(MagicType))> schema;
+        for (size_t magic = 0; magic < schema.size(); magic++)
+            schema[magic] = describe(magic);
+        return schema;
+    }();
+
+    inline bool is_special(Direction direction, MagicType magic) { return SCHEMA[magic].kind(direction) == SPECIAL; }
+
+    // Reason why f can not be handled, nullptr if it is fine
+    inline const char *validate(Direction direction, const frame &f)
+    {
+        const frame_descriptor &descriptor = SCHEMA[f.magic];
+        switch (descriptor.kind(direction))
+        {
+        case INVALID:
+            return descriptor.role == ROLE_UNKNOWN ? "unknown magic" : "not allowed in this direction";
+        case SPECIAL:
+            return f.length < Magic::MAX_CONNECTIONS ? nullptr : "connection number out of range";
+        default:
+            if (f.length < descriptor.minLength)
+                return "payload too short";
+            if (descriptor.valid && !descriptor.valid(f))
+                return "malformed payload";
+            return nullptr;
+        }
+    }
+
+    // O(1) dispatch over MagicType. Handler provides static functions named after the roles
+    // (data, connect, disconnect, request_connect, accept_connect, log, log_level, fragment, hello, credit,
+    // flow_state, send_many, attach, send_fd, send_queue) taking a frame, plus reject(frame, reason). Roles without a function are rejected as well.
+    template <typename Handler>
+    class Dispatcher
+    {
+    public:
+        typedef void (*handler)(const frame &);
+
+        static constexpr handler pick(FrameRole role)
+        {
+            switch (role)
+            {
+            case ROLE_DATA:
+                if constexpr (requires { &Handler::data; })
+                    return &Handler::data;
+                break;
+            case ROLE_CONNECT:
+                if constexpr (requires { &Handler::connect; })
+                    return &Handler::connect;
+                break;
+            case ROLE_DISCONNECT:
+                if constexpr (requires { &Handler::disconnect; })
+                    return &Handler::disconnect;
+                break;
+            case ROLE_REQUEST_CONNECT:
+                if constexpr (requires { &Handler::request_connect; })
+                    return &Handler::request_connect;
+                break;
+            case ROLE_ACCEPT_CONNECT:
+                if constexpr (requires { &Handler::accept_connect; })
+                    return &Handler::accept_connect;
+                break;
+            case ROLE_LOG:
+                if constexpr (requires { &Handler::log; })
+                    return &Handler::log;
+                break;
+            case ROLE_LOG_LEVEL:
+                if constexpr (requires { &Handler::log_level; })
+                    return &Handler::log_level;
+                break;
+            case ROLE_FRAGMENT:
+                if constexpr (requires { &Handler::fragment; })
+                    return &Handler::fragment;
+                break;
+            case ROLE_HELLO:
+                if constexpr (requires { &Handler::hello; })
+                    return &Handler::hello;
+                break;
+            case ROLE_CREDIT:
+                if constexpr (requires { &Handler::credit; })
+                    return &Handler::credit;
+                break;
+            case ROLE_FLOW_STATE:
+                if constexpr (requires { &Handler::flow_state; })
+                    return &Handler::flow_state;
+                break;
+            case ROLE_SEND_MANY:
+                if constexpr (requires { &Handler::send_many; })
+                    return &Handler::send_many;
+                break;
+            case ROLE_ATTACH:
+                if constexpr (requires { &Handler::attach; })
+                    return &Handler::attach;
+                break;
+            case ROLE_SEND_FD:
+                if constexpr (requires { &Handler::send_fd; })
+                    return &Handler::send_fd;
+                break;
+            case ROLE_SEND_QUEUE:
+                if constexpr (requires { &Handler::send_queue; })
+                    return &Handler::send_queue;
+                break;
+            default:
+                break;
+            }
+            return nullptr;
+        }
+
+        static constexpr std::array<handler, SCHEMA.size()> table = []
+        {
+            std::array<handler, SCHEMA.size()> table{};
+            for (size_t magic = 0; magic < table.size(); magic++)
+                table[magic] = pick(SCHEMA[magic].role);
+            return table;
+        }();
+
+        // Returns false if the frame was rejected
+        static bool dispatch(Direction direction, const frame &f)
+        {
+            const char *reason = validate(direction, f);
+            handler h = table[f.magic];
+            if (!reason && !h)
+                reason = "no handler";
+            if (reason)
+            {
+                Handler::reject(f, reason);
+                return false;
+            }
+            h(f);
+            return true;
+        }
+    };
+
+    // ** Capabilities **
+    enum Feature : uint32_t
+    {
+        FEATURE_VARINT = 1 << 0,      // VARINT framing
+        FEATURE_BATCHING = 1 << 1,    // Output may hold frames back for flushDelay, without it every write goes through
+        FEATURE_SHM = 1 << 2,         // Understands --shm-fd. The transport is picked at spawn, this is for the next spawn
+        FEATURE_COMPRESSION = 1 << 3, // Reserved, nobody implements it yet
+        FEATURE_BINARY_LOGS = 1 << 4, // LOG_FORMAT / LOG_RECORD instead of text logs
+        FEATURE_CREDITS = 1 << 5,     // Understands CREDIT / FLOW_STATE
+        FEATURE_FD_PASSING = 1 << 6,  // SEND_FD, only on a unix socket (daemon mode)
+        FEATURE_SEND_QUEUE = 1 << 7   // Understands SEND_QUEUE
+    };
+    const unsigned char PROTOCOL_VERSION = 1;
+    const FrameLengthType HELLO_SIZE = 5;
+
+    inline uint32_t features = 0; // What was agreed on, 0 until a HELLO went through
+
+    // dst has to hold HELLO_SIZE bytes
+    inline FrameLengthType encode_hello(char *dst, uint32_t features)
+    {
+        dst[0] = PROTOCOL_VERSION;
+        for (int i = 0; i < 4; i++)
+            dst[1 + i] = (char)(features >> (8 * i));
+        return HELLO_SIZE;
+    }
+
+    // Little endian, the payload numbers of HELLO, CREDIT, FLOW_STATE, ATTACH
+    inline uint32_t decode_u32(const char *src)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++)
+            value |= (uint32_t)(unsigned char)src[i] << (8 * i);
+        return value;
+    }
+
+    inline uint64_t decode_u64(const char *src) { return decode_u32(src) | (uint64_t)decode_u32(src + 4) << 32; }
+
+    inline void encode_u64(char *dst, uint64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+            dst[i] = (char)(value >> (8 * i));
+    }
+
+    // Feature bits of a validated HELLO frame, including ones we do not know
+    inline uint32_t decode_hello(const frame &f) { return decode_u32(f.message + 1); }
+
+    inline uint32_t negotiate(uint32_t local, uint32_t remote) { return local & remote; }
+
+    // Returns len, 0 on EOF or -1 on error
+    int buffer_read_all(int fd, char *buf, int len)
+    {
+        int d = len;
         while (d > 0)
         {
+            int m = read(fd, buf, d);
+            if (m == 0)
+                return 0;
+            if (m < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
             buf += m;
-            m = read(fd, buf, d);
             d -= m;
         }
+        return len;
     }
 
-    void buffer_send_socket_all(TCPSocket<> *socket, char *buf, int len)
+    void buffer_send_socket_all(TCPSocket<> *socket, const char *buf, int len)
     {
         int m = socket->Send(buf, len);
         int d = len - m;
@@ -94,64 +467,952 @@ namespace Api
             m = write(fd, buffer->buf, d);
             d -= m;
         }
+        int len = buffer->len;
         free(buffer->buf);
         free(buffer);
-        return buffer->len;
+        return len;
+    }
+
+    // Zero allocation encoding
+    // The prefix goes into caller provided storage (usually the stack), the payload is never copied.
+    // dst has to hold max_prefix_size() bytes, returns the prefix size
+    int encode_prefix(char *dst, MagicType mag, FrameLengthType message_length)
+    {
+        memcpy(dst, &mag, MAGIC_TYPE_SIZE);
+        if (frameMode == FIXED)
+        {
+            MessageLengthType fixed_length = message_length;
+            memcpy(dst + MAGIC_TYPE_SIZE, &fixed_length, MESSAGE_LENGTH_TYPE_SIZE);
+            return PREFIX_SIZE;
+        }
+        int n = MAGIC_TYPE_SIZE;
+        while (message_length >= 0x80)
+        {
+            dst[n++] = (char)(message_length | 0x80);
+            message_length >>= 7;
+        }
+        dst[n++] = (char)message_length;
+        return n;
+    }
+
+    // Decodes the prefix in buf. Returns the prefix size, 0 if more bytes are needed or -1 if malformed
+    inline int decode_prefix(const char *buf, size_t available, MagicType *mag, FrameLengthType *message_length)
+    {
+        if (available < (size_t)MAGIC_TYPE_SIZE + 1)
+            return 0;
+        memcpy(mag, buf, MAGIC_TYPE_SIZE);
+        if (frameMode == FIXED)
+        {
+            if (available < (size_t)PREFIX_SIZE)
+                return 0;
+            MessageLengthType fixed_length;
+            memcpy(&fixed_length, buf + MAGIC_TYPE_SIZE, MESSAGE_LENGTH_TYPE_SIZE);
+            *message_length = fixed_length;
+            return PREFIX_SIZE;
+        }
+        const unsigned char *p = (const unsigned char *)buf + MAGIC_TYPE_SIZE;
+        if (p[0] < 0x80) [[likely]] // Short chat frames, no loop
+        {
+            *message_length = p[0];
+            return MAGIC_TYPE_SIZE + 1;
+        }
+        FrameLengthType value = 0;
+        for (int i = 0; i < VARINT_MAX_SIZE; i++)
+        {
+            if ((size_t)MAGIC_TYPE_SIZE + i >= available)
+                return 0;
+            value |= (FrameLengthType)(p[i] & 0x7f) << (7 * i);
+            if (p[i] < 0x80)
+            {
+                *message_length = value;
+                return MAGIC_TYPE_SIZE + i + 1;
+            }
+        }
+        return -1;
+    }
+
+    // dst has to hold max_prefix_size() + message_length bytes
+    int encode(char *dst, MagicType mag, const char *message_buffer, FrameLengthType message_length)
+    {
+        int n = encode_prefix(dst, mag, message_length);
+        memcpy(dst + n, message_buffer, message_length);
+        return n + message_length;
+    }
+
+    // Like buffer_write but for scattered buffers, retries on short writes and EINTR
+    int writev_all(int fd, struct iovec *iov, int iovcnt)
+    {
+        int total = 0;
+        while (iovcnt > 0)
+        {
+            ssize_t m = writev(fd, iov, iovcnt);
+            if (m < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            total += m;
+            while (iovcnt > 0 && (size_t)m >= iov->iov_len)
+            {
+                m -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0)
+            {
+                iov->iov_base = (char *)iov->iov_base + m;
+                iov->iov_len -= m;
+            }
+        }
+        return total;
+    }
+
+    // Header and payload go out as two iovecs in one syscall, no heap involved
+    int frame_write(int fd, MagicType mag, const char *message_buffer, FrameLengthType message_length)
+    {
+        char prefix[MAX_PREFIX_SIZE];
+        int prefix_size = encode_prefix(prefix, mag, message_length);
+        struct iovec iov[2] = {{prefix, (size_t)prefix_size}, {(void *)message_buffer, message_length}};
+        return writev_all(fd, iov, message_length > 0 ? 2 : 1);
+    }
+
+    int frame_write_special(int fd, MagicType mag, MagicType mag_as_message_length)
+    {
+        char prefix[MAX_PREFIX_SIZE];
+        int prefix_size = encode_prefix(prefix, mag, mag_as_message_length);
+        struct iovec iov = {prefix, (size_t)prefix_size};
+        return writev_all(fd, &iov, 1);
+    }
+
+    // ** Fragmentation **
+    // Data for a connection that does not fit into one frame goes out as FRAGMENT frames [connId][chunk] of
+    // fragment_chunk() bytes each, followed by a regular frame with the rest, which keeps at least 2 bytes.
+    inline size_t fragment_chunk() { return max_message_length() - MAGIC_TYPE_SIZE; }
+    inline size_t fragment_count(size_t message_length) { return message_length > max_message_length() ? (message_length - 2) / fragment_chunk() : 0; }
+
+    // frame(mag, lead, data, length) for every frame of the message, lead points to the connId in FRAGMENT frames
+    // and is nullptr in the final one. Stops at the first negative result, returns -1 then or the sum
+    template <typename Frame>
+    int split_message(MagicType connId, const char *message_buffer, size_t message_length, Frame frame)
+    {
+        size_t chunk = fragment_chunk();
+        int total = 0;
+        for (size_t i = fragment_count(message_length); i > 0; i--)
+        {
+            int m = frame(Magic::FRAGMENT, &connId, message_buffer, chunk);
+            if (m < 0)
+                return -1;
+            total += m;
+            message_buffer += chunk;
+            message_length -= chunk;
+        }
+        int m = frame(connId, nullptr, message_buffer, message_length);
+        return m < 0 ? -1 : total + m;
     }
 
     // Make buffer methods
     buffer *make_buffer_special(MagicType mag, MagicType mag_as_message_length)
     {
         buffer *prefix_buffer = (buffer *)malloc(sizeof(buffer));
-        prefix_buffer->len = PREFIX_SIZE;
-        prefix_buffer->buf = (char *)malloc(prefix_buffer->len);
-        memcpy(prefix_buffer->buf, &mag, MAGIC_TYPE_SIZE);
-        memcpy(prefix_buffer->buf + MAGIC_TYPE_SIZE, &mag_as_message_length, MESSAGE_LENGTH_TYPE_SIZE);
+        prefix_buffer->buf = (char *)malloc(MAX_PREFIX_SIZE);
+        prefix_buffer->len = encode_prefix(prefix_buffer->buf, mag, mag_as_message_length);
         return prefix_buffer;
     }
 
-    buffer *make_buffer(MagicType mag, const char *message_buffer, MessageLengthType message_length)
+    buffer *make_buffer(MagicType mag, const char *message_buffer, size_t message_length)
     {
-        if (message_length > MAX_MESSAGE_LENGTH)
+        if (mag < Magic::MAX_CONNECTIONS && message_length > max_message_length()) // Becomes FRAGMENT frames + final frame in one buffer
+        {
+            buffer *full_message_buffer = (buffer *)malloc(sizeof(buffer));
+            full_message_buffer->buf = (char *)malloc(fragment_count(message_length) * (max_prefix_size() + MAGIC_TYPE_SIZE) + max_prefix_size() + message_length);
+            char *iter = full_message_buffer->buf;
+            split_message(mag, message_buffer, message_length, [&iter](MagicType frame_mag, const MagicType *lead, const char *data, size_t length)
+                          {
+                              size_t lead_size = lead ? MAGIC_TYPE_SIZE : 0;
+                              iter += encode_prefix(iter, frame_mag, lead_size + length);
+                              if (lead)
+                                  memcpy(iter, lead, lead_size);
+                              memcpy(iter + lead_size, data, length);
+                              iter += lead_size + length;
+                              return 0; });
+            full_message_buffer->len = iter - full_message_buffer->buf;
+            return full_message_buffer;
+        }
+        if (message_length > max_message_length())
         {
             std::string text = "[make_buffer] message length is bigger than ";
-            text += std::to_string(MAX_MESSAGE_LENGTH);
+            text += std::to_string(max_message_length());
             perror(text.c_str());
             exit(1);
         }
         buffer *full_message_buffer = (buffer *)malloc(sizeof(buffer));
-        full_message_buffer->len = PREFIX_SIZE + message_length;
-        full_message_buffer->buf = (char *)malloc(full_message_buffer->len);
-        memcpy(full_message_buffer->buf, &mag, MAGIC_TYPE_SIZE);
-        memcpy(full_message_buffer->buf + MAGIC_TYPE_SIZE, &message_length, MESSAGE_LENGTH_TYPE_SIZE);
-        memcpy(full_message_buffer->buf + MAGIC_TYPE_SIZE + MESSAGE_LENGTH_TYPE_SIZE, message_buffer, message_length);
+        full_message_buffer->buf = (char *)malloc(max_prefix_size() + message_length);
+        full_message_buffer->len = encode(full_message_buffer->buf, mag, message_buffer, message_length);
         return full_message_buffer;
     }
 
-    // Log calls
-    template <typename... T>
-    const int log(MagicType log, std::format_string<T...> fmt, T &&...args)
+    // ** Input decoding **
+    // Pulls big chunks from fd and hands out as many complete frames per read as are available.
+    // Payloads are views into the decoder storage, nothing is copied out.
+    const int DECODER_SIZE = MAX_FULL_MESSAGE_SIZE * 4; // Grows to fit the varint framing
+
+    class Decoder
     {
-        std::string str;
-        auto it = std::back_inserter(str);
-        std::format_to_n_result r = std::format_to_n(it, MAX_MESSAGE_LENGTH, fmt, std::forward<T>(args)...);
-        int n = r.size;
-        assert(n <= MAX_MESSAGE_LENGTH);
-        return buffer_write(LOG_FILENO, make_buffer(log, str.c_str(), n));
-    }
-    template <typename... T>
-    auto log_info(std::format_string<T...> fmt, T &&...args) { return log(LOG_INFO, fmt, std::forward<T>(args)...); }
-    template <typename... T>
-    auto log_error(std::format_string<T...> fmt, T &&...args) { return log(LOG_ERROR, fmt, std::forward<T>(args)...); }
+    public:
+        int fd;
+        Ring *ring = nullptr; // Read from shared memory instead of fd
+        Direction direction; // Of the frames being read
+        char *storage;
+        size_t size = DECODER_SIZE;
+        size_t head = 0;               // First undecoded byte
+        size_t tail = 0;               // One past the last read byte
+        const char *error = nullptr;   // Set when the stream is malformed, there is no way to resync after that
+        bool passFds = false;          // fd is a unix socket, collect SCM_RIGHTS descriptors into fds
+        std::deque<int> fds;           // Received, not yet claimed by a SEND_FD frame
+
+        Decoder(int fd, Direction direction = INBOUND)
+        {
+            this->fd = fd;
+            this->direction = direction;
+            storage = (char *)malloc(DECODER_SIZE);
+        }
+        ~Decoder()
+        {
+            free(storage);
+            for (int passed : fds)
+                close(passed);
+        }
+
+        // Returns bytes read, 0 on EOF or -1 on error. Invalidates views handed out by next()
+        ssize_t fill()
+        {
+            size_t needed = max_full_message_size();
+            if (size < needed * 2) // Framing changed to varint
+            {
+                size = needed * 2;
+                storage = (char *)realloc(storage, size);
+            }
+            if (head > 0 && size - tail < needed) // Partial frame might not fit, compact
+            {
+                memmove(storage, storage + head, tail - head);
+                tail -= head;
+                head = 0;
+            }
+            while (true)
+            {
+                ssize_t m = ring ? ring->read(storage + tail, size - tail) : passFds ? receive(storage + tail, size - tail)
+                                                                                     : read(fd, storage + tail, size - tail);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m > 0)
+                    tail += m;
+                return m;
+            }
+        }
+
+        // Decodes the next complete frame, false if more bytes are needed
+        bool next(frame &f)
+        {
+            size_t available = tail - head;
+            int prefix_size = decode_prefix(storage + head, available, &f.magic, &f.length);
+            if (prefix_size <= 0 || f.length > max_message_length())
+            {
+                if (prefix_size != 0)
+                    error = "malformed frame length";
+                return false;
+            }
+            size_t payload = is_special(direction, f.magic) ? 0 : f.length;
+            if (available < prefix_size + payload)
+                return false;
+            f.message = storage + head + prefix_size;
+            head += prefix_size + payload;
+            if (head == tail)
+                head = tail = 0;
+            return true;
+        }
+
+        // Bytes of a partial frame left over, non zero at EOF means the stream was cut
+        size_t pending() { return tail - head; }
+
+    private:
+        ssize_t receive(char *buf, size_t len)
+        {
+            char control[CMSG_SPACE(sizeof(int) * PASS_FDS_MAX)];
+            struct iovec iov = {buf, len};
+            struct msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t m = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+            if (m < 0)
+                return m;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                    continue;
+                int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (int i = 0; i < count; i++)
+                {
+                    int passed;
+                    memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    fds.push_back(passed);
+                }
+            }
+            // Descriptors are matched to SEND_FD frames in order, one lost or extra one and every later frame
+            // would send the wrong file, so there is no going on after that
+            if (msg.msg_flags & MSG_CTRUNC)
+                error = "descriptors were truncated";
+            else if (fds.size() > PASS_FDS_QUEUED)
+                error = "too many descriptors without SEND_FD";
+            if (error)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            return m;
+        }
+    };
+
+    // ** Reassembly **
+    // Hands messages to onChunk(connId, message, length, last) piece by piece as the FRAGMENT frames come in.
+    // Nothing is buffered, so memory stays bounded no matter how big the message is.
+    class Reassembler
+    {
+    public:
+        size_t maxMessageSize = 0; // 0 is unlimited, bigger messages are dropped
+        size_t inProgress[Magic::MAX_CONNECTIONS] = {};
+        bool dropping[Magic::MAX_CONNECTIONS] = {};
+        unsigned long dropped = 0;
+
+        // Returns false if f is not a data or FRAGMENT frame
+        template <typename Func>
+        bool feed(const frame &f, Func onChunk)
+        {
+            bool last = f.magic < Magic::MAX_CONNECTIONS;
+            if (!last && f.magic != Magic::FRAGMENT)
+                return false;
+            if (!last && f.length < (FrameLengthType)MAGIC_TYPE_SIZE)
+                return true; // Malformed, ignore
+            MagicType connId = last ? f.magic : (MagicType)f.message[0];
+            if (connId >= Magic::MAX_CONNECTIONS)
+                return true;
+            const char *message = last ? f.message : f.message + MAGIC_TYPE_SIZE;
+            size_t length = last ? f.length : f.length - MAGIC_TYPE_SIZE;
+            inProgress[connId] += length;
+            if (maxMessageSize && inProgress[connId] > maxMessageSize && !dropping[connId])
+            {
+                dropping[connId] = true;
+                dropped++;
+            }
+            if (!dropping[connId])
+                onChunk(connId, message, length, last);
+            if (last)
+            {
+                inProgress[connId] = 0;
+                dropping[connId] = false;
+            }
+            return true;
+        }
+    };
+
+    // ** Output batching **
+    // Frames are staged and handed to the kernel in one writev. The staging area is flushed when
+    //     1. it holds more than flushBytes
+    //     2. the oldest staged frame waited longer than flushDelay (background flusher)
+    //     3. a control frame (CONNECT, DISCONNECT, ...) is written
+    // A flushDelay of zero makes every write go straight through. That is how it starts, a frontend that never
+    // sends HELLO sees one write per frame as before. HELLO with BATCHING switches to batchDelay.
+    //
+    // ** Priority lanes **
+    // Control frames (SCHEMA control) do not queue behind data. They go into their own small lane which is
+    // written before any data writev, so a control frame waits for at most the one data write in flight,
+    // never for a whole fragmented message. Control frames can therefore overtake data staged earlier.
+    // Lifecycle frames (CONNECT, DISCONNECT, REQUEST_CONNECT) must not, a peer's last message has to arrive
+    // before its DISCONNECT. They go behind the staged data and flush it.
+    // Lock order is lock (data lane) -> ioLock (one writev) -> controlLock.
+    const int OUTPUT_STAGING_SIZE = MAX_FULL_MESSAGE_SIZE;
+    const int CONTROL_STAGING_SIZE = 4096;
+
+    class Output
+    {
+    public:
+        int fd;
+        Ring *ring = nullptr;     // Write to shared memory instead of fd
+        Fanout *fanout = nullptr; // Daemon mode, write to every attached client instead of fd
+        size_t flushBytes = 16 * 1024;
+        std::chrono::microseconds flushDelay{0};   // Until HELLO agrees on BATCHING, or --flush-delay-us
+        std::chrono::microseconds batchDelay{200}; // What BATCHING turns on
+
+        // Counters, frames / syscalls is what you want to tune against
+        std::atomic<unsigned long> frames = 0;
+        std::atomic<unsigned long> syscalls = 0;
+        std::atomic<unsigned long> bytes = 0;
+        std::atomic<unsigned long> flushesSize = 0;
+        std::atomic<unsigned long> flushesDelay = 0;
+        std::atomic<unsigned long> flushesControl = 0;
+        // Head of line delay of the control lane, from staging until the frame is handed to the kernel
+        std::atomic<unsigned long> controlFrames = 0;
+        std::atomic<unsigned long> controlDelayTotalNs = 0;
+        std::atomic<unsigned long> controlDelayMaxNs = 0;
+
+        char staging[OUTPUT_STAGING_SIZE];
+        size_t staged = 0;
+        int stagedFrames = 0;
+        std::chrono::steady_clock::time_point stagedSince;
+        std::mutex lock;
+        std::condition_variable stagedCondition;
+        std::thread flusher;
+        bool running = false;
+
+        char controlStaging[CONTROL_STAGING_SIZE];
+        size_t controlStaged = 0;
+        std::chrono::steady_clock::time_point controlSince;
+        std::mutex controlLock;
+        std::mutex ioLock;
+        std::atomic<bool> spliceBroken = false;
+
+        Output(int fd) { this->fd = fd; }
+
+        ~Output()
+        {
+            lock.lock();
+            bool wasRunning = running;
+            running = false;
+            flushLocked();
+            lock.unlock();
+            drainControl();
+            stagedCondition.notify_one();
+            if (wasRunning)
+                flusher.join();
+        }
+
+        double framesPerSyscall() { return syscalls ? (double)frames / syscalls : 0; }
+        double controlDelayAverageUs() { return controlFrames ? controlDelayTotalNs / 1000.0 / controlFrames : 0; }
+
+        int write(MagicType mag, const char *message_buffer, FrameLengthType message_length, bool control = false)
+        {
+            if (control && message_length + MAX_PREFIX_SIZE <= CONTROL_STAGING_SIZE)
+                return writeControl(mag, message_buffer, message_length);
+            std::unique_lock<std::mutex> guard(lock);
+            return stageLocked(mag, nullptr, message_buffer, message_length, control);
+        }
+
+        // Data for a connection. Anything that does not fit into one frame is split into FRAGMENT frames,
+        // which go out back to back so the receiver can stream them straight through.
+        int writeMessage(MagicType connId, const char *message_buffer, size_t message_length)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            return split_message(connId, message_buffer, message_length, [this](MagicType mag, const MagicType *lead, const char *data, size_t length)
+                                 { return stageLocked(mag, lead, data, length, false); });
+        }
+
+        // lead is an optional magic written in front of the payload, it counts towards the frame length
+        int stageLocked(MagicType mag, const MagicType *lead, const char *message_buffer, FrameLengthType message_length, bool control)
+        {
+            if (!running && flushDelay.count() > 0)
+            {
+                running = true;
+                flusher = std::thread([this] { flushLoop(); });
+            }
+            size_t lead_size = lead ? MAGIC_TYPE_SIZE : 0;
+            FrameLengthType frame_length = lead_size + message_length;
+            if (frame_length > max_message_length())
+                return -1;
+            if (capture)
+                capture->record(OUTBOUND, mag, frame_length, lead, lead_size, message_buffer, message_length);
+            char prefix[MAX_PREFIX_SIZE];
+            int prefix_size = encode_prefix(prefix, mag, frame_length);
+            int len = prefix_size + frame_length;
+            frames++;
+            if (staged + len > sizeof(staging)) // Does not fit, staged bytes + frame go out together
+            {
+                struct iovec iov[4] = {{staging, staged}, {prefix, (size_t)prefix_size}, {(void *)lead, lead_size}, {(void *)message_buffer, message_length}};
+                stagedFrames++;
+                flushesSize++;
+                return writeLocked(iov, 4) < 0 ? -1 : len;
+            }
+            if (staged == 0)
+                stagedSince = std::chrono::steady_clock::now();
+            memcpy(staging + staged, prefix, prefix_size);
+            if (lead)
+                memcpy(staging + staged + prefix_size, lead, lead_size);
+            memcpy(staging + staged + prefix_size + lead_size, message_buffer, message_length);
+            staged += len;
+            stagedFrames++;
+            if (control)
+            {
+                flushesControl++;
+                flushLocked();
+            }
+            else if (staged >= flushBytes || flushDelay.count() == 0)
+            {
+                flushesSize++;
+                flushLocked();
+            }
+            else if (stagedFrames == 1)
+                stagedCondition.notify_one();
+            return len;
+        }
+
+        static bool isLifecycle(MagicType mag) { return mag == Magic::CONNECT || mag == Magic::DISCONNECT || mag == Magic::REQUEST_CONNECT; }
+
+        int writeSpecial(MagicType mag, MagicType mag_as_message_length, bool control = true)
+        {
+            // The length field carries mag_as_message_length, so this must not go through write()
+            if (control && !isLifecycle(mag))
+                return writeControl(mag, nullptr, mag_as_message_length);
+            if (capture)
+                capture->record(OUTBOUND, mag, mag_as_message_length, nullptr, 0, nullptr, 0);
+            std::unique_lock<std::mutex> guard(lock);
+            if (staged + MAX_PREFIX_SIZE > sizeof(staging))
+                flushLocked();
+            int prefix_size = encode_prefix(staging + staged, mag, mag_as_message_length);
+            staged += prefix_size;
+            stagedFrames++;
+            frames++;
+            if (control)
+                flushesControl++;
+            return flushLocked() < 0 ? -1 : prefix_size;
+        }
+
+        // message_buffer is nullptr for special frames, message_length is the connection number then
+        int writeControl(MagicType mag, const char *message_buffer, FrameLengthType message_length)
+        {
+            size_t payload = message_buffer ? message_length : 0;
+            if (capture)
+                capture->record(OUTBOUND, mag, message_length, nullptr, 0, message_buffer, payload);
+            while (true)
+            {
+                std::unique_lock<std::mutex> guard(controlLock);
+                if (controlStaged + MAX_PREFIX_SIZE + payload > sizeof(controlStaging))
+                {
+                    guard.unlock();
+                    drainControl();
+                    continue;
+                }
+                if (controlStaged == 0)
+                    controlSince = std::chrono::steady_clock::now();
+                int prefix_size = encode_prefix(controlStaging + controlStaged, mag, message_length);
+                if (payload)
+                    memcpy(controlStaging + controlStaged + prefix_size, message_buffer, payload);
+                controlStaged += prefix_size + payload;
+                frames++;
+                controlFrames++;
+                flushesControl++;
+                break;
+            }
+            // Waits for at most the data write in flight, which drains this lane first anyway
+            return drainControl();
+        }
+
+        int drainControl()
+        {
+            std::unique_lock<std::mutex> io(ioLock);
+            return drainControlLocked();
+        }
+
+        // ioLock has to be held
+        int drainControlLocked()
+        {
+            std::unique_lock<std::mutex> guard(controlLock);
+            if (controlStaged == 0)
+                return 0;
+            unsigned long delay = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - controlSince).count();
+            controlDelayTotalNs += delay;
+            if (delay > controlDelayMaxNs)
+                controlDelayMaxNs = delay;
+            struct iovec iov = {controlStaging, controlStaged};
+            int m = sinkWritev(&iov, 1);
+            syscalls++;
+            if (m > 0)
+                bytes += m;
+            controlStaged = 0;
+            return m;
+        }
+
+        int flush()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            int m = flushLocked();
+            return drainControl() < 0 ? -1 : m;
+        }
+
+        // Answer a HELLO. The answer still goes out in the old framing, everything staged after it uses the new one
+        int writeHello(uint32_t agreed)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            flushLocked();
+            std::unique_lock<std::mutex> io(ioLock);
+            drainControlLocked();
+            std::unique_lock<std::mutex> control(controlLock);
+            char hello[HELLO_SIZE + MAX_PREFIX_SIZE];
+            FrameLengthType hello_size = encode_hello(hello + MAX_PREFIX_SIZE, agreed);
+            if (capture)
+                capture->record(OUTBOUND, Magic::HELLO, hello_size, nullptr, 0, hello + MAX_PREFIX_SIZE, hello_size);
+            int prefix_size = encode_prefix(hello, Magic::HELLO, hello_size);
+            memmove(hello + prefix_size, hello + MAX_PREFIX_SIZE, hello_size);
+            struct iovec iov = {hello, prefix_size + hello_size};
+            int m = sinkWritev(&iov, 1);
+            frames++;
+            syscalls++;
+            frameMode = agreed & FEATURE_VARINT ? VARINT : FIXED;
+            flushDelay = agreed & FEATURE_BATCHING ? batchDelay : std::chrono::microseconds(0);
+            features = agreed;
+            return m;
+        }
+
+        // ** Zero copy relay **
+        // Moves what the socket from has, up to one frame, to fd through the pipe. Only the prefix is written
+        // from user space, the payload never leaves the kernel. Returns what splice(2) from the socket returned.
+        // Only for a plain fd, shared memory, fan out and captures need the bytes
+        bool canSplice() const { return !ring && !fanout && !capture && !spliceBroken; }
+
+        ssize_t spliceMessage(MagicType connId, int from, const int pipe[2])
+        {
+            ssize_t n = splice(from, nullptr, pipe[1], nullptr, max_message_length(), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0)
+                return n;
+            std::unique_lock<std::mutex> guard(lock);
+            flushLocked(); // Staged frames are older
+            std::unique_lock<std::mutex> io(ioLock);
+            drainControlLocked();
+            char prefix[MAX_PREFIX_SIZE];
+            struct iovec iov = {prefix, (size_t)encode_prefix(prefix, connId, n)};
+            bool failed = writev_all(fd, &iov, 1) < 0; // Without its prefix the payload must not go out
+            ssize_t moved = 0;
+            char chunk[4096];
+            while (!failed && moved < n)
+            {
+                ssize_t m = spliceBroken ? -1 : splice(pipe[0], nullptr, fd, nullptr, n - moved, SPLICE_F_MOVE);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m < 0 && errno == EAGAIN) // The output is full, wait like a blocking write would
+                {
+                    struct pollfd writable = {fd, POLLOUT, 0};
+                    poll(&writable, 1, -1);
+                    continue;
+                }
+                if (m < 0 && (spliceBroken || errno == EINVAL || errno == ENOSYS)) // fd does not take splices (a tty), copy the rest
+                {
+                    spliceBroken = true;
+                    m = read(pipe[0], chunk, std::min<size_t>(sizeof(chunk), n - moved));
+                    struct iovec rest = {chunk, (size_t)std::max<ssize_t>(m, 0)};
+                    if (m > 0 && writev_all(fd, &rest, 1) < 0)
+                        m = -1;
+                }
+                failed = m <= 0;
+                if (!failed)
+                    moved += m;
+                syscalls++;
+            }
+            if (failed) // The output is gone, the pipe must be empty for the next message
+                while (read(pipe[0], chunk, sizeof(chunk)) > 0)
+                    ;
+            frames++;
+            syscalls++;
+            bytes += iov.iov_len + moved;
+            return n;
+        }
+
+        int flushLocked()
+        {
+            if (staged == 0)
+                return 0;
+            struct iovec iov = {staging, staged};
+            return writeLocked(&iov, 1);
+        }
+
+        int sinkWritev(struct iovec *iov, int iovcnt)
+        {
+            if (fanout)
+                return fanout->writev(iov, iovcnt);
+            return ring ? ring->writev(iov, iovcnt) : writev_all(fd, iov, iovcnt);
+        }
+
+        // Data lane write, pending control frames go first
+        int writeLocked(struct iovec *iov, int iovcnt)
+        {
+            std::unique_lock<std::mutex> io(ioLock);
+            drainControlLocked();
+            int m = sinkWritev(iov, iovcnt);
+            syscalls++;
+            if (m > 0)
+                bytes += m;
+            staged = 0;
+            stagedFrames = 0;
+            return m;
+        }
+
+        void flushLoop()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (running)
+            {
+                if (staged == 0)
+                {
+                    stagedCondition.wait(guard);
+                    continue;
+                }
+                auto deadline = stagedSince + flushDelay;
+                if (std::chrono::steady_clock::now() < deadline)
+                {
+                    stagedCondition.wait_until(guard, deadline);
+                    continue;
+                }
+                flushesDelay++;
+                flushLocked();
+            }
+        }
+    };
+
+    inline Output out(API_OUT_FILENO);
+
+    // Schema generated encoders, a frame that is not valid in the direction does not compile
+    template <MagicType M, Direction D = OUTBOUND>
+        requires(SCHEMA[M].kind(D) == SPECIAL)
+    int emit(MagicType connId, Output &output = out) { return output.writeSpecial(M, connId, SCHEMA[M].control); }
+
+    template <MagicType M, Direction D = OUTBOUND>
+        requires(SCHEMA[M].kind(D) == PAYLOAD)
+    int emit(const char *message, FrameLengthType length, Output &output = out) { return output.write(M, message, length, SCHEMA[M].control); }
+
+    // ** Credit based flow control **
+    // The frontend grants bytes of connection data with CREDIT frames. Until the first CREDIT arrives
+    // everything flows as before, so frontends that do not know about credits are not affected.
+    // Once credits are used up, data is kept per connection (up to maxPending bytes) and anything beyond
+    // that is shed, so a slow frontend costs memory and messages but never blocks a socket thread.
+    // Control frames and logs are not counted. A message is sent whole as long as there is any credit
+    // left, so the balance can go negative, a frontend should grant well ahead.
+    // Every state change of a connection is announced with FLOW_STATE [connId][state][pending u32][shed u32].
+    enum FlowState : unsigned char
+    {
+        FLOW_OPEN,
+        FLOW_BUFFERING,
+        FLOW_SHEDDING
+    };
+    const FrameLengthType FLOW_STATE_SIZE = 2 + 2 * sizeof(uint32_t);
+
+    class FlowControl
+    {
+    public:
+        size_t maxPending = 1 << 20; // Per connection
+
+        bool enabled = false;
+        long long credits = 0;
+        std::deque<std::string> pending[Magic::MAX_CONNECTIONS];
+        size_t pendingBytes[Magic::MAX_CONNECTIONS] = {};
+        size_t shedBytes[Magic::MAX_CONNECTIONS] = {};
+        FlowState state[Magic::MAX_CONNECTIONS] = {};
+        bool draining = false; // A grant is writing out kept messages, new ones queue behind them
+        std::condition_variable drained;
+        std::mutex lock;
+
+        // The lock only covers the accounting, writes to the frontend can block and happen after it is released.
+        // That includes FLOW_STATE, state changes are collected under the lock and delivered after
+        int send(MagicType connId, const char *message, size_t length)
+        {
+            Deliver later{this};
+            std::unique_lock<std::mutex> guard(lock);
+            if (!enabled)
+            {
+                guard.unlock();
+                return out.writeMessage(connId, message, length);
+            }
+            if (credits > 0 && pending[connId].empty() && !draining) // Nothing granted earlier is still on its way
+            {
+                credits -= length;
+                guard.unlock();
+                return out.writeMessage(connId, message, length);
+            }
+            if (pendingBytes[connId] + length > maxPending)
+            {
+                shedBytes[connId] += length;
+                setState(connId, FLOW_SHEDDING);
+                return 0;
+            }
+            pending[connId].emplace_back(message, length);
+            pendingBytes[connId] += length;
+            if (state[connId] == FLOW_OPEN)
+                setState(connId, FLOW_BUFFERING);
+            return 0;
+        }
+
+        // CREDIT, drains the kept messages round robin. One grant drains at a time, a CREDIT arriving
+        // meanwhile only adds to the balance and the running one keeps going
+        void grant(uint32_t bytes)
+        {
+            Deliver later{this};
+            std::unique_lock<std::mutex> guard(lock);
+            enabled = true;
+            credits += bytes;
+            if (draining)
+                return;
+            draining = true;
+            std::vector<std::pair<MagicType, std::string>> batch;
+            while (true)
+            {
+                bool more = true;
+                while (credits > 0 && more)
+                {
+                    more = false;
+                    for (int connId = 0; connId < Magic::MAX_CONNECTIONS && credits > 0; connId++)
+                    {
+                        if (pending[connId].empty())
+                            continue;
+                        std::string &message = pending[connId].front();
+                        credits -= message.size();
+                        pendingBytes[connId] -= message.size();
+                        batch.emplace_back(connId, std::move(message));
+                        pending[connId].pop_front();
+                        if (pending[connId].empty())
+                            setState(connId, FLOW_OPEN);
+                        else
+                            more = true;
+                    }
+                }
+                if (batch.empty())
+                    break;
+                guard.unlock();
+                deliver();
+                for (auto &[connId, message] : batch)
+                    out.writeMessage(connId, message.data(), message.size());
+                batch.clear();
+                guard.lock();
+            }
+            draining = false;
+            drained.notify_all();
+        }
+
+        // The connection is gone, whatever it still had is dropped. Waits out a running grant, so nothing
+        // of the connection is written after its DISCONNECT
+        void reset(MagicType connId)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            drained.wait(guard, [this] { return !draining; });
+            pending[connId].clear();
+            pendingBytes[connId] = 0;
+            shedBytes[connId] = 0;
+            state[connId] = FLOW_OPEN;
+        }
+
+    private:
+        std::vector<std::array<char, FLOW_STATE_SIZE>> notices; // FLOW_STATE frames not written yet
+        std::atomic<bool> noticed = false;                        // notices is not empty
+        std::mutex noticeLock;                                    // Keeps deliveries in order, taken before lock
+
+        // Declared before the lock is taken, writes the collected FLOW_STATE frames once it is released
+        struct Deliver
+        {
+            FlowControl *flow;
+            ~Deliver() { flow->deliver(); }
+        };
+
+        void deliver()
+        {
+            if (!noticed)
+                return;
+            std::unique_lock<std::mutex> order(noticeLock);
+            std::vector<std::array<char, FLOW_STATE_SIZE>> frames;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                frames.swap(notices);
+                noticed = false;
+            }
+            for (auto &message : frames)
+                emit<Magic::FLOW_STATE>(message.data(), FLOW_STATE_SIZE);
+        }
+
+        void setState(MagicType connId, FlowState newState)
+        {
+            if (state[connId] == newState)
+                return;
+            state[connId] = newState;
+            std::array<char, FLOW_STATE_SIZE> &message = notices.emplace_back();
+            message[0] = connId;
+            message[1] = newState;
+            uint32_t numbers[2] = {(uint32_t)pendingBytes[connId], (uint32_t)std::min<size_t>(shedBytes[connId], UINT32_MAX)};
+            for (int i = 0; i < 8; i++)
+                message[2 + i] = (char)(numbers[i / 4] >> (8 * (i % 4)));
+            noticed = true;
+        }
+    };
+
+    inline FlowControl flow;
 
     // Make buffers for api
-    buffer *api_make_buffer_message(MagicType connId, const char *message, MessageLengthType length) { return make_buffer(connId, message, length); }
+    buffer *api_make_buffer_message(MagicType connId, const char *message, size_t length) { return make_buffer(connId, message, length); }
     buffer *api_make_buffer_connect(MagicType connId) { return make_buffer_special(Magic::CONNECT, connId); }
     buffer *api_make_buffer_disconnect(MagicType connId) { return make_buffer_special(Magic::DISCONNECT, connId); }
     buffer *api_make_buffer_request_connect(MagicType connId) { return make_buffer_special(Magic::REQUEST_CONNECT, connId); }
 
     inline int api_buffer_write(buffer *buffer) { return buffer_write(API_OUT_FILENO, buffer); }
 
+    // Allocation free variants of the above, use these on hot paths. They go through the batching Output.
+    inline int api_write_message(MagicType connId, const char *message, size_t length) { return flow.send(connId, message, length); }
+    inline int api_write_connect(MagicType connId) { return emit<Magic::CONNECT>(connId); }
+    inline int api_write_disconnect(MagicType connId) { return emit<Magic::DISCONNECT>(connId); }
+    inline int api_write_request_connect(MagicType connId) { return emit<Magic::REQUEST_CONNECT>(connId); }
+    inline int api_flush() { return out.flush(); }
+
+    // ** Send queues **
+    // With --io epoll|uring every peer has a bounded queue of bytes the kernel did not take yet.
+    // Crossing the high watermark, hitting the limit and draining back to the low watermark are announced
+    // with SEND_QUEUE [connId][state][queued u32][dropped u32], to frontends that agreed on FEATURE_SEND_QUEUE.
+    enum QueueState : unsigned char
+    {
+        QUEUE_LOW,  // Drained to the low watermark, write freely again
+        QUEUE_HIGH, // Above the high watermark, slow down
+        QUEUE_FULL  // At the limit, the full queue policy kicks in
+    };
+    const FrameLengthType SEND_QUEUE_SIZE = 2 + 2 * sizeof(uint32_t);
+
+    inline int send_queue_state(MagicType connId, QueueState state, size_t queued, size_t dropped)
+    {
+        if (!(features & FEATURE_SEND_QUEUE))
+            return 0;
+        char message[SEND_QUEUE_SIZE];
+        message[0] = connId;
+        message[1] = state;
+        uint32_t numbers[2] = {(uint32_t)std::min<size_t>(queued, UINT32_MAX), (uint32_t)std::min<size_t>(dropped, UINT32_MAX)};
+        for (int i = 0; i < 8; i++)
+            message[2 + i] = (char)(numbers[i / 4] >> (8 * (i % 4)));
+        return emit<Magic::SEND_QUEUE>(message, SEND_QUEUE_SIZE);
+    }
+
+    // SEND_MANY bitmap, bit connId % 8 of byte connId / 8
+    inline void bitmap_set(char *bitmap, MagicType connId) { bitmap[connId / 8] |= 1 << (connId % 8); }
+    inline bool bitmap_test(const char *bitmap, MagicType connId) { return bitmap[connId / 8] & (1 << (connId % 8)); }
+
+    // ** Descriptor passing **
+    // Frontend side of SEND_FD. Messages above ZERO_COPY_THRESHOLD should be put into a sealed memfd
+    // and handed over with this instead of going through the pipe, delta sendfile()s it to the peer.
+    // fd can be closed right after, delta holds its own reference.
+    const size_t ZERO_COPY_THRESHOLD = 64 * 1024;
+
+    inline int send_fd_frame(int sock, MagicType connId, int fd, uint64_t length)
+    {
+        char payload[MAGIC_TYPE_SIZE + sizeof(uint64_t)];
+        payload[0] = connId;
+        encode_u64(payload + MAGIC_TYPE_SIZE, length);
+        char message[MAX_PREFIX_SIZE + sizeof(payload)];
+        int size = encode(message, Magic::SEND_FD, payload, sizeof(payload));
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        struct iovec iov = {message, (size_t)size};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == size ? size : -1;
+    }
+
 }
 
 template <>
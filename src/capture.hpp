@@ -0,0 +1,152 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <mutex>
+
+/* ** Capture files **
+ *  delta --record <path> tees every Api frame of both directions into an append only file,
+ *  delta --replay <path> feeds the inbound frames back into the dispatcher, at recorded speed or
+ *  with --replay-fast as fast as possible.
+ *
+ *  Layout, host byte order, everything 8 byte aligned so the reader walks the mmap in place:
+ *     capture_header
+ *     capture_record, payload padded to 8 bytes
+ *     ...
+ *  Frames are stored decoded, so a capture does not depend on the framing that was in use.
+ *  Special frames have no payload, their length is the connection number.
+ *  A crash leaves at most one truncated record at the end, the reader stops in front of it.
+ */
+#define CAPTURE_MAGIC 0x70616364 // "dcap"
+#define CAPTURE_VERSION 1
+
+namespace Api
+{
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t startRealtimeNs; // Wall clock of time 0
+    } capture_header;
+
+    typedef struct
+    {
+        uint64_t time;        // ns since the capture started, monotonic
+        uint32_t length;      // As in frame.length
+        uint32_t payloadSize; // Bytes following the record
+        uint8_t direction;    // Api::Direction
+        uint8_t magic;
+        uint8_t reserved[6];
+    } capture_record;
+
+    inline uint64_t clock_ns(clockid_t clock)
+    {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    class CaptureWriter
+    {
+    public:
+        FILE *file = nullptr;
+        uint64_t start = 0;
+        unsigned long records = 0;
+        std::mutex lock;
+
+        bool open(const char *path)
+        {
+            file = fopen(path, "wb");
+            if (!file)
+                return false;
+            setvbuf(file, nullptr, _IOFBF, 1 << 20);
+            capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION, clock_ns(CLOCK_REALTIME)};
+            start = clock_ns(CLOCK_MONOTONIC);
+            return fwrite(&header, sizeof(header), 1, file) == 1;
+        }
+
+        // lead goes in front of the payload, like the connId of a FRAGMENT
+        void record(uint8_t direction, uint8_t magic, uint32_t length, const void *lead, size_t leadSize, const char *payload, size_t payloadSize)
+        {
+            static const char padding[8] = {};
+            std::unique_lock<std::mutex> guard(lock);
+            if (!file)
+                return;
+            // Stamped under the lock, so times in the file never go backwards and replay does not reorder
+            capture_record record = {clock_ns(CLOCK_MONOTONIC) - start, length, (uint32_t)(leadSize + payloadSize), direction, magic, {}};
+            fwrite(&record, sizeof(record), 1, file);
+            if (leadSize)
+                fwrite(lead, 1, leadSize, file);
+            if (payloadSize)
+                fwrite(payload, 1, payloadSize, file);
+            fwrite(padding, 1, -record.payloadSize & 7, file);
+            records++;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (file)
+                fclose(file);
+            file = nullptr;
+        }
+    };
+
+    class CaptureReader
+    {
+    public:
+        const char *map = nullptr;
+        size_t size = 0;
+        size_t offset = sizeof(capture_header);
+        const capture_header *header = nullptr;
+
+        bool open(const char *path)
+        {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(capture_header))
+            {
+                ::close(fd);
+                return false;
+            }
+            size = st.st_size;
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED)
+                return false;
+            map = (const char *)mapped;
+            header = (const capture_header *)map;
+            return header->magic == CAPTURE_MAGIC && header->version == CAPTURE_VERSION;
+        }
+
+        // payload points into the mapping. false at the end
+        bool next(const capture_record *&record, const char *&payload)
+        {
+            if (offset + sizeof(capture_record) > size)
+                return false;
+            record = (const capture_record *)(map + offset);
+            size_t end = offset + sizeof(capture_record) + ((record->payloadSize + 7) & ~(size_t)7);
+            if (end > size)
+                return false;
+            payload = map + offset + sizeof(capture_record);
+            offset = end;
+            return true;
+        }
+
+        ~CaptureReader()
+        {
+            if (map)
+                munmap((void *)map, size);
+        }
+    };
+
+    inline CaptureWriter *capture = nullptr; // Set by --record
+}
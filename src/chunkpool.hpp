@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include "api.hpp"
+
+/* ** Chunk pool **
+ *  What a peer sends before it is accepted waits in a chain of fixed size chunks.
+ *  Chunks come from one pool shared by every connection, taken when the first bytes arrive and given back
+ *  on accept or close, so a connection that is accepted right away costs nothing.
+ *  The pool hands out at most cap bytes in total, a chain at most its own limit.
+ */
+namespace Delta
+{
+    class ChunkPool
+    {
+    public:
+        static constexpr size_t CHUNK_SIZE = 16 * 1024; // Below MAX_MESSAGE_LENGTH, a chunk is one frame
+        static constexpr size_t KEEP_CHUNKS = 64;       // Given back chunks kept for reuse, the rest is freed
+        static_assert(CHUNK_SIZE <= Api::MAX_MESSAGE_LENGTH);
+
+        struct Chunk
+        {
+            Chunk *next = nullptr;
+            size_t used = 0;
+            char data[CHUNK_SIZE];
+        };
+
+        size_t cap = 16 * 1024 * 1024; // --pre-message-pool-bytes
+
+        // nullptr once cap is reached
+        Chunk *take()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if ((taken + 1) * CHUNK_SIZE > cap)
+                return nullptr;
+            taken++;
+            Chunk *chunk = spare;
+            if (chunk)
+            {
+                spare = chunk->next;
+                spareCount--;
+            }
+            else
+                chunk = new Chunk();
+            chunk->next = nullptr;
+            chunk->used = 0;
+            return chunk;
+        }
+
+        // The whole chain from chunk on
+        void give(Chunk *chunk)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (chunk)
+            {
+                Chunk *next = chunk->next;
+                taken--;
+                if (spareCount < KEEP_CHUNKS)
+                {
+                    chunk->next = spare;
+                    spare = chunk;
+                    spareCount++;
+                }
+                else
+                    delete chunk;
+                chunk = next;
+            }
+        }
+
+    private:
+        std::mutex lock;
+        Chunk *spare = nullptr;
+        size_t spareCount = 0;
+        size_t taken = 0;
+    };
+
+    inline ChunkPool chunkPool;
+
+    // The bytes of one connection, in order. Not synchronized, the owner locks
+    class ChunkChain
+    {
+    public:
+        static inline size_t limit = Api::MAX_PRE_MESSAGE_LENGTH; // Per connection, --pre-message-bytes
+
+        ChunkChain() = default;
+        ChunkChain(const ChunkChain &) = delete;
+        ChunkChain &operator=(const ChunkChain &) = delete;
+        ~ChunkChain() { release(); }
+
+        size_t size() const { return bytes; }
+
+        // All or nothing, false if the limit or the pool's cap would be exceeded
+        bool append(const char *data, size_t length)
+        {
+            if (bytes + length > limit)
+                return false;
+            size_t room = tail ? ChunkPool::CHUNK_SIZE - tail->used : 0;
+            ChunkPool::Chunk *first = nullptr, *last = nullptr;
+            for (size_t need = length > room ? length - room : 0; need > 0; need -= std::min(need, ChunkPool::CHUNK_SIZE))
+            {
+                ChunkPool::Chunk *chunk = chunkPool.take();
+                if (!chunk)
+                {
+                    chunkPool.give(first);
+                    return false;
+                }
+                (last ? last->next : first) = chunk;
+                last = chunk;
+            }
+            if (first)
+            {
+                (tail ? tail->next : head) = first;
+                if (!tail)
+                    tail = first;
+            }
+            bytes += length;
+            while (length > 0)
+            {
+                if (tail->used == ChunkPool::CHUNK_SIZE)
+                    tail = tail->next;
+                size_t n = std::min(length, ChunkPool::CHUNK_SIZE - tail->used);
+                memcpy(tail->data + tail->used, data, n);
+                tail->used += n;
+                data += n;
+                length -= n;
+            }
+            return true;
+        }
+
+        // func(data, length) for every chunk, in order
+        template <typename Func>
+        void forEach(Func func) const
+        {
+            for (ChunkPool::Chunk *chunk = head; chunk && chunk->used; chunk = chunk->next)
+                func(chunk->data, chunk->used);
+        }
+
+        void release()
+        {
+            chunkPool.give(head);
+            head = tail = nullptr;
+            bytes = 0;
+        }
+
+    private:
+        ChunkPool::Chunk *head = nullptr;
+        ChunkPool::Chunk *tail = nullptr; // Last one with data, new chunks hang behind it until filled
+        size_t bytes = 0;
+    };
+}
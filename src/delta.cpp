@@ -2,67 +2,71 @@
 
 namespace Delta
 {
-    Connection *connections[Api::MAX_CONNECTIONS];
-    MagicType nextFreeConnection = 0; // = Amount of connections
-    std::mutex connectionsLock;
+    // Slot = connId on the wire, stable for the life of the connection. Lookups hold an Epoch::Guard
+    SlotMap<Connection, Api::MAX_CONNECTIONS> connections;
+    // Threads mode reads from a thread per connection, plus up to 64 shards and a few helpers,
+    // and a thread per daemon client
+    static_assert(Epoch::MAX_READERS >= Api::MAX_CONNECTIONS + 64 + 16 + Api::FANOUT_MAX_CLIENTS);
+
+    // Daemon mode, see fanout.hpp
+    Api::Fanout *fanout = nullptr;
+    std::mutex dispatchLock;               // Handlers expect one caller at a time
+    thread_local int currentClient = -1;   // Api client whose frame is being handled
+    thread_local Api::Decoder *currentDecoder = nullptr; // Its decoder, holds passed descriptors
+    std::atomic<int> clientCount = 0;      // Served right now, at most Api::FANOUT_MAX_CLIENTS
 
     // C Programmers would say this is bad but they can suck my balls
 
     void Connection::socketHandleClose(int errorCode)
     {
-        idLock.lock();
-        Api::log_info("Connection {} closed: {}", id, errorCode);
-        deletedLock.lock();
-        if (!deleted)
-        {
-            deleted = true;
-            deletedLock.unlock();
-            connectionsLock.lock();
-            if (id < nextFreeConnection) // We valid
-            {
-                MagicType connId = id;
-                idLock.unlock();
-                delete this;
-                if (connId < nextFreeConnection - 1) // We are not in the last position
-                {                                    // Swap
-                    connections[connId] = connections[nextFreeConnection - 1];
-                }
-                nextFreeConnection--;
-            }
-            else
-            {
-                idLock.unlock();
-            }
-            connectionsLock.unlock();
-        }
-        else
+        MagicType connId = getId();
+        Api::log_info("Connection {} closed: {}", connId, errorCode);
+        if (!beginClose()) // Whoever closed it takes it out of the table
+            return;
+        releasePreMessageBuffer();
+        if (connections.remove(handle, [](Connection *connection) { delete connection; }))
         {
-            idLock.unlock();
-            deletedLock.unlock();
+            Api::flow.reset(connId);
+            Api::api_write_disconnect(connId); // The frontend must not address connId anymore
         }
     }
 
     void Connection::createSocket()
     {
-        (*socket) = TCPSocket<>([](int errorCode, std::string errorMessage)
-                                { Api::log_info("Socket creation error: %d : %s", errorCode, errorMessage); });
+        if (!shards.empty()) // onConnect finishes it
+        {
+            shard = shards[getId() % shards.size()];
+            peer = shard->connect(ip, port, handle);
+            if (!peer)
+            {
+                int error = errno;
+                Api::log_info("Connection failed: {}:{} : {}", ip, port, strerror(error));
+                socketHandleClose(error); // Out of the table, the frontend gets DISCONNECT
+            }
+            return;
+        }
+        socket = new TCPSocket<>([](int errorCode, std::string errorMessage)
+                                 { Api::log_info("Socket creation error: {} : {}", errorCode, errorMessage); });
 
-        socket->onRawMessageReceived = [this](const char *message, int length)
+        // Callbacks go through the table, they may fire after the connection was removed
+        socket->onRawMessageReceived = [handle = handle](const char *message, int length)
         {
-            idLock.lock();
-            Api::buffer *buffer = Api::api_make_buffer_message(id, message, length);
-            idLock.unlock();
-            Api::api_buffer_write(buffer);
+            Epoch::Guard guard(connections.epoch);
+            if (connections.get(handle))
+                Api::api_write_message(SlotMap<Connection, Api::MAX_CONNECTIONS>::slotOf(handle), message, length);
         };
 
-        socket->onSocketClosed = [this](int errorCode)
-        { this->socketHandleClose(errorCode); };
+        socket->onSocketClosed = [handle = handle](int errorCode)
+        {
+            Epoch::Guard guard(connections.epoch);
+            Connection *connection = connections.get(handle);
+            if (connection)
+                connection->socketHandleClose(errorCode);
+        };
 
         socket->Connect(
             ip, port, [this] { // TODO Send accept to api out
-                idLock.lock();
-                Api::log_info("Connection %d accepted", id);
-                idLock.unlock();
+                Api::log_info("Connection {} accepted", getId());
                 this->setAccepted();
             },
             [this](int errorCode, std::string errorMessage)
@@ -70,258 +74,728 @@ namespace Delta
                 // TODO Connection refused
                 // Maybe retry logic
                 this->setAccepted(false);
-                Api::log_info("Connection failed: %d : %s", errorCode, errorMessage);
+                Api::log_info("Connection failed: {} : {}", errorCode, errorMessage);
             });
     }
 
-    void Connection::registerWith()
+    // false if the table (or the stripe of slots with slot % stripes == stripe) is full
+    bool Connection::registerWith(int stripe, int stripes)
+    {
+        handle = connections.insert(this, stripe, stripes);
+        if (handle == connections.INVALID_HANDLE)
+            return false;
+        setId(connections.slotOf(handle));
+        return true;
+    }
+
+    // Bytes from the peer, straight to the frontend once accepted, into the preMessageBuffer until then
+    void Connection::receive(const char *message, int length)
     {
-        connectionsLock.lock();
-        if (nextFreeConnection < Api::MAX_CONNECTIONS)
-        {
-            idLock.lock();
-            id = nextFreeConnection;
-            connections[nextFreeConnection] = this;
-            nextFreeConnection++;
-            idLock.unlock();
+        if (passThrough) // Connection accepted, nothing buffered is left
+        {
+            Api::api_write_message(getId(), message, length);
+            return;
         }
-        else
-            throw std::invalid_argument("Max connections");
-        connectionsLock.unlock();
+        // Save messages to buffer while connection is not accepted
+        if (!addToPreMessageBuffer(message, length))
+        {
+            std::string notice = std::format("preMessageBuffer full, {} bytes dropped", length);
+            socketSendMessage(notice.c_str(), notice.size());
+            return;
+        }
+        Api::log_info("Message from the Client {}:{} with {} bytes into preMessageBuffer", ip, port, length);
     }
 
+    // Closes the socket and takes the connection out of the table, the memory goes once no reader can see it
     void Connection::destory()
     {
-        connectionsLock.lock();
-        idLock.lock();
-        MagicType connId = id;
-        if (connId < nextFreeConnection) // We valid
-        {
-            idLock.unlock();
-            delete this;
-            if (connId < nextFreeConnection - 1) // We are not in the last position
-            {                                    // Swap
-                connections[connId] = connections[nextFreeConnection - 1];
-            }
-            nextFreeConnection--;
+        MagicType connId = getId();
+        if (beginClose())
+        {
+            releasePreMessageBuffer();
+            closeSocket();
+        }
+        if (connections.remove(handle, [](Connection *connection) { delete connection; }))
+            Api::flow.reset(connId);
+    }
+
+    // Connection that may be written to, nullptr (and logged) otherwise. handle() holds the Epoch::Guard
+    Connection *acceptedConnection(MagicType connId)
+    {
+        Connection *connection = connections.at(connId);
+        if (!connection)
+        {
+            Api::log_error("  Connection {} is invalid", connId);
+            return nullptr;
+        }
+        if (!connection->isAccepted())
+        {
+            Api::log_error("  Connection {} is not accepted", connId);
+            return nullptr;
+        }
+        return connection;
+    }
+
+    // One CONNECT target, "ip:port"
+    void connectTo(std::string_view address)
+    {
+        size_t colon = address.rfind(':');
+        if (colon == std::string_view::npos)
+        {
+            Api::log_error("  Invalid address {}", address);
+            return;
+        }
+        std::string ip(address.substr(0, colon));
+        int port = atoi(std::string(address.substr(colon + 1)).c_str());
+        Connection *connection = new Connection(ip, port);
+        if (!connection->registerWith())
+        {
+            delete connection;
+            Api::log_error("  Connection limit reached {}", Api::MAX_CONNECTIONS);
+            return;
+        }
+        // Send confirmation of CONNECT to client, before anything the connection itself may report
+        Api::api_write_connect(connection->getId());
+        connection->createSocket();
+    }
+
+    void ApiHandler::connect(const Api::frame &frame) // Client requests CONNECT to one or more sockets
+    {
+        std::string_view targets(frame.message, frame.length);
+        while (!targets.empty())
+        {
+            size_t end = targets.find('\n');
+            std::string_view address = targets.substr(0, end);
+            if (!address.empty())
+                connectTo(address);
+            targets.remove_prefix(end == std::string_view::npos ? targets.size() : end + 1);
+        }
+    }
+
+    void ApiHandler::disconnect(const Api::frame &frame) // Client requests DISCONNECT from socket
+    {
+        MagicType connId = (MagicType)frame.length;
+        Connection *connection = connections.at(connId);
+        if (!connection) // Is valid Connection
+        {
+            Api::log_error("  Connection {} is invalid", connId);
+            return;
+        }
+        connection->destory();
+
+        // Send confirmation of DISCONNECT to client
+        Api::api_write_disconnect(connId);
+    }
+
+    void ApiHandler::accept_connect(const Api::frame &frame) // Client wants to ACCEPT_CONNECT an incoming connection
+    {
+        MagicType connId = (MagicType)frame.length;
+        Connection *connection = connections.at(connId);
+        if (!connection) // Is valid Connection
+        {
+            Api::log_error("  Connection {} is invalid", connId);
+            return;
         }
+        // Process preMessageBuffer
+        if (!connection->acceptPreMessageBuffer([&connId](char *iter, MessageLengthType length) { //
+                Api::api_write_message(connId, iter, length);
+            })) // Is not already accepted
+            Api::log_error("  Connection {} was already accepted", connId);
+    }
+
+    void ApiHandler::log_level(const Api::frame &frame)
+    {
+        Api::logLevel = std::min<FrameLengthType>(frame.length, Api::LEVEL_OFF);
+    }
+
+    void ApiHandler::hello(const Api::frame &frame)
+    {
+        uint32_t offered = Api::decode_hello(frame);
+        uint32_t supported = Api::FEATURE_VARINT | Api::FEATURE_BATCHING | Api::FEATURE_SHM | Api::FEATURE_BINARY_LOGS |
+                             Api::FEATURE_CREDITS | Api::FEATURE_SEND_QUEUE;
+        uint32_t agreed = Api::negotiate(supported, offered);
+        if (fanout) // Clients share one stream, what it carries is reported as it is and never changed by one of them
+        {
+            uint32_t shared = Api::FEATURE_VARINT | Api::FEATURE_BATCHING | Api::FEATURE_BINARY_LOGS | Api::FEATURE_SEND_QUEUE;
+            uint32_t current = (Api::frameMode == Api::VARINT ? (uint32_t)Api::FEATURE_VARINT : 0u) |
+                               (Api::out.flushDelay.count() > 0 ? (uint32_t)Api::FEATURE_BATCHING : 0u) |
+                               (Api::binaryLogs ? (uint32_t)Api::FEATURE_BINARY_LOGS : 0u) |
+                               (Api::features & Api::FEATURE_SEND_QUEUE);
+            agreed = (agreed & ~shared) | current;
+        }
+        if (currentDecoder) // Descriptors only travel over the unix socket
+            agreed |= offered & Api::FEATURE_FD_PASSING;
+        if (fanout && currentClient >= 0) // The answer is for this client only, the broadcast would hand it to all
+        {
+            char payload[Api::HELLO_SIZE];
+            char answer[Api::MAX_PREFIX_SIZE + sizeof(payload)];
+            FrameLengthType size = Api::encode_hello(payload, agreed);
+            if (Api::capture)
+                Api::capture->record(Api::OUTBOUND, Api::Magic::HELLO, size, nullptr, 0, payload, size);
+            fanout->reply(currentClient, answer, Api::encode(answer, Api::Magic::HELLO, payload, size));
+            Api::log_info("Client {} negotiated features {:#x} (offered {:#x}, version {})", currentClient, agreed, offered, (int)frame.message[0]);
+            return;
+        }
+        Api::out.writeHello(agreed);
+        if (Api::logSink.target == Api::TARGET_API) // --log-fd and --log-file keep what the command line chose
+            Api::binaryLogs = agreed & Api::FEATURE_BINARY_LOGS; // Only now, no record may go out before the answer
+        Api::log_info("Negotiated features {:#x} (offered {:#x}, version {})", agreed, offered, (int)frame.message[0]);
+    }
+
+    void ApiHandler::credit(const Api::frame &frame)
+    {
+        Api::flow.grant(Api::decode_u32(frame.message));
+    }
+
+    void ApiHandler::fragment(const Api::frame &frame) // Part of a big message, stream it straight to the socket
+    {
+        Connection *connection = acceptedConnection((MagicType)frame.message[0]);
+        if (connection)
+            connection->socketSendMessage(frame.message + Api::MAGIC_TYPE_SIZE, frame.length - Api::MAGIC_TYPE_SIZE);
+    }
+
+    void ApiHandler::data(const Api::frame &frame) // Send message to one of connected sockets
+    {
+        Connection *connection = acceptedConnection(frame.magic);
+        if (connection)
+            connection->socketSendMessage(frame.message, frame.length);
+        // TODO Confirm message sent back to client
+    }
+
+    void ApiHandler::send_many(const Api::frame &frame) // One message to every connection in the bitmap
+    {
+        const char *bitmap = frame.message;
+        const char *message = frame.message + Api::CONNECTION_BITMAP_SIZE;
+        FrameLengthType length = frame.length - Api::CONNECTION_BITMAP_SIZE;
+        for (int connId = 0; connId < Api::MAX_CONNECTIONS; connId++)
+        {
+            if (!Api::bitmap_test(bitmap, connId))
+                continue;
+            Connection *connection = acceptedConnection(connId);
+            if (connection)
+                connection->socketSendMessage(message, length);
+        }
+    }
+
+    void ApiHandler::attach(const Api::frame &frame) // (Re)attach this client to the outbound stream
+    {
+        if (!fanout || currentClient < 0)
+        {
+            Api::log_error("  ATTACH without daemon mode");
+            return;
+        }
+        uint64_t requested = Api::decode_u64(frame.message);
+        uint64_t from = fanout->attach(currentClient, requested, [](char *dst, uint64_t sequence)
+                                       {
+                                           char payload[sizeof(uint64_t)];
+                                           Api::encode_u64(payload, sequence);
+                                           return (size_t)Api::encode(dst, Api::Magic::ATTACH, payload, sizeof(payload)); });
+        Api::logFormats.undefineAll(); // The client may have missed them
+        if (requested != Api::ATTACH_LIVE && requested != from)
+            Api::log_error("  Client {} asked for {}, history starts later, resumed at {}", currentClient, requested, from);
         else
-            idLock.unlock();
-        connectionsLock.unlock();
+            Api::log_info("Client {} attached at {}", currentClient, from);
     }
 
-    void serve()
+    void ApiHandler::send_fd(const Api::frame &frame) // Big payload handed over as a descriptor, see send_fd_frame
     {
-        char magicBuffer[Api::MAGIC_TYPE_SIZE];
-        char messageLengthBuffer[Api::MESSAGE_LENGTH_TYPE_SIZE];
-        char messageBuffer[Api::MAX_MESSAGE_LENGTH];
-        MessageLengthType messageLength;
-        MagicType magic, connId;
+        if (!currentDecoder || currentDecoder->fds.empty())
+        {
+            Api::log_error("  SEND_FD without a descriptor");
+            return;
+        }
+        int fd = currentDecoder->fds.front();
+        currentDecoder->fds.pop_front();
+        uint64_t length = Api::decode_u64(frame.message + Api::MAGIC_TYPE_SIZE);
+        Connection *connection = acceptedConnection((MagicType)frame.message[0]);
+        if (connection)
+        {
+            size_t sent = connection->socketSendFile(fd, length);
+            if (sent < length)
+                Api::log_error("  Connection {} took {} of {} bytes: {}", (int)(MagicType)frame.message[0], sent, length, strerror(errno));
+        }
+        close(fd);
+    }
+
+    void ApiHandler::reject(const Api::frame &frame, const char *reason)
+    {
+        Api::log_error("  Rejected frame {} with length {}: {}", frame.magic, frame.length, reason);
+        if (frame.magic == Api::Magic::SEND_FD && currentDecoder && !currentDecoder->fds.empty()) // Its descriptor goes with it
+        {
+            close(currentDecoder->fds.front());
+            currentDecoder->fds.pop_front();
+        }
+    }
 
-        Connection *connection = nullptr;
-        // buffer *buffer;
+    void handle(const Api::frame &frame)
+    {
+        Epoch::Guard guard(connections.epoch); // Handlers look connections up
+        if (Api::capture)
+            Api::capture->record(Api::INBOUND, frame.magic, frame.length, nullptr, 0, frame.message,
+                                 Api::is_special(Api::INBOUND, frame.magic) ? 0 : frame.length);
+        Api::Dispatcher<ApiHandler>::dispatch(Api::INBOUND, frame);
+    }
 
-        std::string ip;
-        int port;
+    // One daemon client, frames are handled like serve() does, one client at a time
+    void serveClient(int fd)
+    {
+        Api::Decoder decoder(fd, Api::INBOUND);
+        decoder.passFds = true;
+        Api::frame frame;
+        currentClient = fd;
+        currentDecoder = &decoder;
         while (true)
         {
-            Api::buffer_read_all(STDIN_FILENO, magicBuffer, Api::MAGIC_TYPE_SIZE);
-            Api::buffer_read_all(STDIN_FILENO, messageLengthBuffer, Api::MESSAGE_LENGTH_TYPE_SIZE);
-            // Convert 2 Bytes to ushort
-            memcpy(&messageLength, &messageLengthBuffer, Api::MESSAGE_LENGTH_TYPE_SIZE);
-            Api::buffer_read_all(STDIN_FILENO, messageBuffer, messageLength);
-            memcpy(&magic, magicBuffer, Api::MAGIC_TYPE_SIZE);
-            switch (magic)
+            if (!decoder.next(frame))
             {
-            case Api::Magic::CONNECT: // Client requests CONNECT to socket
+                if (!decoder.error && decoder.fill() > 0)
+                    continue;
+                break;
+            }
+            dispatchLock.lock();
+            handle(frame);
+            dispatchLock.unlock();
+        }
+        fanout->detach(fd);
+        close(fd);
+        if (decoder.error)
+            Api::log_error("  Client {} dropped: {}", fd, decoder.error);
+        else
+            Api::log_info("Client {} detached", fd);
+        clientCount--;
+    }
+
+    // Long lived, accepts Api clients on a unix socket instead of serving stdin
+    void serveUnix(const char *path)
+    {
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        unlink(path);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 16) < 0)
+        {
+            fprintf(stderr, "Can not listen on %s: %s\n", path, strerror(errno));
+            return;
+        }
+        Api::log_info("Api clients are accepted on {}", path);
+        while (true)
+        {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
             {
-                connectionsLock.lock();
-                if (nextFreeConnection == Api::MAX_CONNECTIONS)
-                {
-                    connectionsLock.unlock();
-                    Api::log_error("  Connection limit reached {}", Api::MAX_CONNECTIONS);
-                    break;
-                }
-                connectionsLock.unlock();
-                ip = strtok(messageBuffer, ":");
-                port = atoi(strtok(NULL, ":"));
-                connection = new Connection(ip, port);
-                connection->registerWith();
-                connection->createSocket();
-
-                // Send confirmation of CONNECT to client
-                connection->idLock.lock();
-                Api::buffer *buffer = Api::api_make_buffer_connect(connection->id);
-                connection->idLock.unlock();
-                Api::api_buffer_write(buffer);
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                Api::log_error("  Accepting api clients failed: {}", strerror(errno));
                 break;
             }
-            case Api::Magic::DISCONNECT: // Client requests DISCONNECT from socket
+            if (clientCount.fetch_add(1) >= Api::FANOUT_MAX_CLIENTS) // Every client thread takes an Epoch reader
             {
-                connId = (MagicType)messageLength;
-                connectionsLock.lock();
-                if (connId > nextFreeConnection - 1) // Is valid Connection
-                {
-                    connectionsLock.unlock();
-                    Api::log_error("  Connection {} is invalid", connId);
-                    break;
-                }
-                connection = connections[connId];
-                delete connection;                   // Delete connection
-                if (connId < nextFreeConnection - 1) // We are not in the last position
-                {                                    // Put last pointer in hole
-                    connections[connId] = connections[nextFreeConnection - 1];
-                }
-                nextFreeConnection--;
-                connectionsLock.unlock();
+                clientCount--;
+                close(client);
+                Api::log_error("  Refused an api client, {} are attached already", Api::FANOUT_MAX_CLIENTS);
+                continue;
+            }
+            struct timeval timeout = {1, 0}; // A client that does not read for a second is dropped, it can resume
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::thread(serveClient, client).detach();
+        }
+        close(listener);
+        unlink(path);
+    }
 
-                // Send confirmation of DISCONNECT to client
-                Api::buffer *buffer = Api::api_make_buffer_disconnect(connId);
-                api_buffer_write(buffer);
-                break;
+    void serve()
+    {
+        Api::Decoder decoder(API_IN_FILENO, Api::INBOUND);
+        if (Api::shm)
+            decoder.ring = &Api::shm->in;
+        Api::frame frame;
+        while (true)
+        {
+            if (!decoder.next(frame))
+            {
+                ssize_t m = decoder.error ? -1 : decoder.fill();
+                if (m > 0)
+                    continue;
+                if (decoder.error)
+                    Api::log_error("  Api input is broken: {}", decoder.error);
+                else if (m < 0)
+                    Api::log_error("  Reading api input failed: {}", strerror(errno));
+                else if (decoder.pending() > 0)
+                    Api::log_error("  Api input closed in the middle of a frame, {} bytes dropped", decoder.pending());
+                return;
             }
-            case Api::Magic::ACCEPT_CONNECT: // Client wants to ACCEPT_CONNECT an incoming connection
+            handle(frame);
+        } // while(true)
+    }
+
+    // --splice: an accepted peer's bytes go socket -> pipe -> api output without being copied through user space.
+    // Declines, and the reactor reads as usual, whenever the output has to see the bytes
+    ssize_t spliceToApi(uint32_t handle, int fd)
+    {
+        thread_local int pipe[2] = {-1, -1};
+        Connection *connection = connections.get(handle);
+        if (!connection || !connection->passThrough || Api::flow.enabled || !Api::out.canSplice())
+            return Reactor::SPLICE_DECLINED;
+        if (pipe[0] < 0 && pipe2(pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+            return Reactor::SPLICE_DECLINED;
+        return Api::out.spliceMessage(connection->getId(), fd, pipe);
+    }
+
+    // --io epoll|uring: sockets are served by reactors instead of a thread each.
+    // Every worker is one shard with its own loop, SO_REUSEPORT listener and stripe of connection slots,
+    // so the connId alone tells which shard owns a connection
+    void startShards(std::string io, int workers, int port, bool splice)
+    {
+        signal(SIGPIPE, SIG_IGN); // sendfile(2) has no MSG_NOSIGNAL, a peer that is gone must not end the process
+        for (int k = 0; k < workers; k++)
+        {
+            Reactor *shard = nullptr;
+            if (io == "uring")
             {
-                connId = (MagicType)messageLength;
-                connectionsLock.lock();
-                if (connId > nextFreeConnection - 1) // Is valid Connection
-                {
-                    connectionsLock.unlock();
-                    Api::log_error("  Connection {} is invalid", connId);
-                    break;
-                }
-                connection = connections[connId];
-                connectionsLock.unlock();
-                connection->acceptedLock.lock();
-                if (connection->accepted) // Is not already accepted
+                UringReactor *uring = new UringReactor();
+                if (uring->ok())
+                    shard = uring;
+                else
                 {
-                    connection->acceptedLock.unlock();
-                    Api::log_error("  Connection {} was already accepted", connId);
-                    break;
+                    Api::log_error("  io_uring is not available: {}, using epoll", strerror(errno));
+                    delete uring;
+                    io = "epoll";
                 }
-                connection->accepted = true;
-                connection->acceptedLock.unlock();
-                // Process preMessageBuffer
-                connection->iteratePreMessageBufferChunks([&connId](char *iter, MessageLengthType length) { //
-                    Api::buffer *buffer = Api::api_make_buffer_message(connId, iter, length);
-                    Api::api_buffer_write(buffer);
-                });
-                break;
-            }
-            case Api::Magic::LOG_INFO || Api::Magic::LOG_ERROR:
-            {
-                // Client should not send log messages
-                break;
             }
-            default: // Send message to one of connected sockets
+            if (!shard)
+                shard = new EpollReactor();
+            shards.push_back(shard);
+        }
+        if (splice && io == "uring")
+            Api::log_info("  --splice needs --io epoll, io_uring receives into its buffer ring");
+        for (int k = 0; k < workers; k++)
+        {
+            Reactor *shard = shards[k];
+            shard->epoch = &connections.epoch;
+            shard->reusePort = workers > 1;
+            shard->onAccept = [k, shard](Peer *peer, const sockaddr_in &address) -> uint32_t
             {
-                connId = magic;
-                connectionsLock.lock();
-                if (connId > nextFreeConnection - 1)
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+                Connection *connection = new Connection(shard, peer, ip, ntohs(address.sin_port));
+                if (!connection->registerWith(k, shards.size()))
                 {
-                    connectionsLock.unlock();
-                    Api::log_error("  Connection {} is invalid", connId);
-                    break;
+                    connection->peer = nullptr; // The reactor closes it
+                    delete connection;
+                    return connections.INVALID_HANDLE;
                 }
-                connection = connections[connId];
-                connectionsLock.unlock();
-                if (connection->isAccepted())
+                Api::api_write_request_connect(connection->getId());
+                Api::log_info("New client: [{}:{}] on shard {}", connection->ip, connection->port, k);
+                return connection->handle;
+            };
+            shard->onConnect = [](uint32_t handle, int errorCode)
+            {
+                Connection *connection = connections.get(handle);
+                if (!connection)
+                    return;
+                if (errorCode) // The reactor closes the peer, the slot and the frontend are told here
                 {
-                    Api::log_error("  Connection {} is not accepted", connId);
-                    break;
+                    Api::log_info("Connection failed: {} : {}", errorCode, strerror(errorCode));
+                    connection->socketHandleClose(errorCode);
+                    return;
                 }
-                connection->socketSendMessage(messageBuffer, messageLength);
+                Api::log_info("Connection {} accepted", connection->getId());
+                connection->setAccepted();
+            };
+            shard->onData = [](uint32_t handle, const char *message, size_t length)
+            {
+                Connection *connection = connections.get(handle);
+                if (connection)
+                    connection->receive(message, length);
+            };
+            shard->onClose = [](uint32_t handle, int errorCode)
+            {
+                Connection *connection = connections.get(handle);
+                if (connection)
+                    connection->socketHandleClose(errorCode);
+            };
+            shard->onQueue = [](uint32_t handle, Api::QueueState state, size_t queued, size_t dropped)
+            {
+                Connection *connection = connections.get(handle);
+                if (!connection)
+                    return;
+                Api::send_queue_state(connection->getId(), state, queued, dropped);
+                if (state == Api::QUEUE_FULL)
+                    Api::log_error("  Connection {} send queue is full at {} bytes, {} dropped", connection->getId(), queued, dropped);
+            };
+            if (splice)
+                shard->onSplice = spliceToApi;
+            if (!shard->listen(port))
+                Api::log_info("Listening failed: {} : {}", errno, strerror(errno));
+        }
+    }
 
-                // TODO Confirm message sent back to client
-                break;
-            }
+    // Instead of serve(), feeds the inbound frames of a capture through the same handlers
+    void replay(const char *path, bool fast)
+    {
+        Api::CaptureReader reader;
+        if (!reader.open(path))
+        {
+            Api::log_error("  Can not open capture {}", path);
+            return;
+        }
+        const Api::capture_record *record;
+        const char *payload;
+        unsigned long frames = 0, skipped = 0;
+        uint64_t first = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (reader.next(record, payload))
+        {
+            if (record->direction != Api::INBOUND)
+                continue;
+            if (!Api::is_special(Api::INBOUND, record->magic) && record->length > record->payloadSize) // Corrupted
+            {
+                skipped++;
+                continue;
             }
-        } // while(true)
+            if (frames++ == 0)
+                first = record->time;
+            if (!fast)
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(record->time - first));
+            handle({record->magic, record->length, payload});
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Api::log_info("Replayed {} frames in {:.3f} s ({:.0f} frames/s)", frames, seconds, seconds > 0 ? frames / seconds : 0);
+        if (skipped)
+            Api::log_error("  Skipped {} records whose length runs past their payload", skipped);
     }
 
-    int main(int argc, char **argv)
+    // --decode-log: a binary log file written by --log-file back as text, the same lines a text log would have
+    int decodeLog(const char *path)
     {
-        int listen_port = 8888;
-        if (argc > 1)
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
         {
-            listen_port = atoi(argv[1]);
+            fprintf(stderr, "Can not open log %s\n", path);
+            return 1;
         }
-        // Initialize server socket..
-        TCPServer<> tcpServer;
+        Api::frameMode = Api::FIXED; // Log files never change framing, see LogSink::writeFrame
+        Api::Decoder decoder(fd, Api::OUTBOUND);
+        Api::LogDecoder logs;
+        Api::frame frame;
+        unsigned long bad = 0;
+        while (decoder.fill() > 0)
+            while (decoder.next(frame))
+            {
+                MagicType level;
+                std::string text;
+                if (!logs.feed(frame, &level, &text))
+                    bad++;
+                else if (frame.magic == Api::Magic::LOG_RECORD)
+                    printf("%s%s\n", level == Api::Magic::LOG_ERROR ? "ERROR " : "INFO  ", text.c_str());
+            }
+        close(fd);
+        bool cut = decoder.error || decoder.pending();
+        if (bad)
+            fprintf(stderr, "%lu frames could not be decoded\n", bad);
+        if (cut)
+            fprintf(stderr, "%s ends in a partial frame\n", path);
+        return bad || cut ? 1 : 0;
+    }
 
+    // Default I/O, async-sockets runs a thread per socket
+    void listenThreads(TCPServer<> &tcpServer, int port)
+    {
         tcpServer.onNewConnection = [](TCPSocket<> *newSocket)
         {
-            Connection *connection = nullptr;
-            if (nextFreeConnection < Api::MAX_CONNECTIONS)
-            {
-                connection = new Connection(newSocket);
-                connection->idLock.lock();
-                connectionsLock.lock();
-                connection->id = nextFreeConnection;
-                connections[nextFreeConnection] = connection;
-                nextFreeConnection++;
-                connectionsLock.unlock();
-            }
-            else
+            Connection *connection = new Connection(newSocket);
+            if (!connection->registerWith())
             {
+                connection->socket = nullptr;
+                delete connection;
                 newSocket->Close();
                 return;
             }
-            Api::buffer *buffer;
-            buffer = Api::api_make_buffer_request_connect(connection->id);
-            connection->idLock.unlock();
-            api_buffer_write(buffer);
-            Api::log_info("New client: [%s:%d]", connection->ip, connection->port);
-            connection->socket->onRawMessageReceived = [&connection, &buffer](const char *message, int length)
+            Api::api_write_request_connect(connection->getId());
+            Api::log_info("New client: [{}:{}]", connection->ip, connection->port);
+            // Callbacks go through the table, they may fire after the connection was removed
+            connection->socket->onRawMessageReceived = [handle = connection->handle](const char *message, int length)
             {
-                if (length > Api::MAX_MESSAGE_LENGTH) // Incoming message is too long, abort
-                    return connection->socket->Close();
-                if (connection->isAccepted()) // Connection accepted
-                {
-                    connection->idLock.lock();
-                    buffer = Api::api_make_buffer_message(connection->id, message, length);
-                    connection->idLock.unlock();
-                    api_buffer_write(buffer);
-                }
-                else
-                { // Save messages to buffer while connection is not accepted
-                    connection->preMessageBufferLock.lock();
-                    int d = length - (connection->preMessageBuffer.end() - connection->preMessageBufferFreeSpace);
-                    if (d > 0)
-                    {
-                        connection->preMessageBufferLock.unlock();
-                        connection->socket->Send(std::format("preMessageBuffer overflow by {} bytes", d).c_str());
-                        return;
-                    }
-                    // We copy some arbitary bytes from a stranger on the internet into memory
-                    // This should be safe though, operating systems store this in non-executable memory
-                    // As long as we don't overflow the buffer, we should be fine
-                    memcpy(connection->preMessageBufferFreeSpace, message, length);
-                    connection->preMessageBufferFreeSpace += length;
-                    connection->preMessageBufferLock.unlock();
-                    Api::log_info("Message from the Client %s:%d with %d bytes into preMessageBuffer",
-                                  connection->ip, connection->port, length);
-                }
+                Epoch::Guard guard(connections.epoch);
+                Connection *connection = connections.get(handle);
+                if (connection)
+                    connection->receive(message, length);
             };
 
-            connection->socket->onSocketClosed = [&connection](int errorCode)
-            { connection->socketHandleClose(errorCode); };
+            connection->socket->onSocketClosed = [handle = connection->handle](int errorCode)
+            {
+                Epoch::Guard guard(connections.epoch);
+                Connection *connection = connections.get(handle);
+                if (connection)
+                    connection->socketHandleClose(errorCode);
+            };
         };
 
         // Bind the server to a port.
-        tcpServer.Bind(listen_port, [](int errorCode, std::string errorMessage)
+        tcpServer.Bind(port, [](int errorCode, std::string errorMessage)
                        { Api::log_info("Binding failed: {} : {}", errorCode, errorMessage); });
 
         // Start Listening the server.
         tcpServer.Listen([](int errorCode, std::string errorMessage)
                          { Api::log_info("Listening failed: {} : {}", errorCode, errorMessage); });
+    }
+
+    int main(int argc, char **argv)
+    {
+        int listen_port = 8888;
+        const char *replayPath = nullptr;
+        const char *unixPath = nullptr;
+        size_t historyBytes = Api::FANOUT_DEFAULT_HISTORY_SIZE;
+        bool replayFast = false;
+        std::string io = "threads";
+        int workers = 1;
+        bool splice = false;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--flush-bytes" && i + 1 < argc)
+                Api::out.flushBytes = std::min<size_t>(atoi(argv[++i]), Api::OUTPUT_STAGING_SIZE);
+            else if (arg == "--flush-delay-us" && i + 1 < argc)
+                Api::out.flushDelay = Api::out.batchDelay = std::chrono::microseconds(atoi(argv[++i]));
+            else if (arg == "--binary-logs")
+                Api::binaryLogs = true;
+            else if (arg == "--log-level" && i + 1 < argc)
+            {
+                std::string level = argv[++i];
+                Api::logLevel = level == "error" ? Api::LEVEL_ERROR : level == "off" ? Api::LEVEL_OFF
+                                                                                      : Api::LEVEL_INFO;
+            }
+            else if (arg == "--log-fd" && i + 1 < argc)
+            {
+                Api::logSink.target = Api::TARGET_FD;
+                Api::logSink.fd = atoi(argv[++i]);
+            }
+            else if (arg == "--log-file" && i + 1 < argc)
+            {
+                Api::logSink.target = Api::TARGET_FILE;
+                Api::logSink.path = argv[++i];
+            }
+            else if (arg == "--log-rotate-bytes" && i + 1 < argc)
+                Api::logSink.rotateBytes = atol(argv[++i]);
+            else if (arg == "--max-pending-bytes" && i + 1 < argc)
+                Api::flow.maxPending = atol(argv[++i]);
+            else if (arg == "--varint")
+                Api::frameMode = Api::FrameMode::VARINT;
+            else if (arg == "--record" && i + 1 < argc)
+            {
+                Api::capture = new Api::CaptureWriter();
+                if (!Api::capture->open(argv[++i]))
+                {
+                    fprintf(stderr, "Can not create capture %s\n", argv[i]);
+                    return 1;
+                }
+            }
+            else if (arg == "--replay" && i + 1 < argc)
+                replayPath = argv[++i];
+            else if (arg == "--decode-log" && i + 1 < argc)
+                return decodeLog(argv[++i]);
+            else if (arg == "--replay-fast")
+                replayFast = true;
+            else if (arg == "--listen-unix" && i + 1 < argc)
+                unixPath = argv[++i];
+            else if (arg == "--history-bytes" && i + 1 < argc)
+                historyBytes = std::max(atol(argv[++i]), 4096L);
+            else if (arg == "--io" && i + 1 < argc)
+                io = argv[++i];
+            else if (arg == "--send-queue-bytes" && i + 1 < argc)
+                queueLimits.limit = atol(argv[++i]);
+            else if (arg == "--send-queue-high" && i + 1 < argc)
+                queueLimits.high = atol(argv[++i]);
+            else if (arg == "--send-queue-low" && i + 1 < argc)
+                queueLimits.low = atol(argv[++i]);
+            else if (arg == "--send-queue-block-bytes" && i + 1 < argc)
+                queueLimits.blockLimit = atol(argv[++i]);
+            else if (arg == "--send-queue-policy" && i + 1 < argc)
+            {
+                std::string policy = argv[++i];
+                queueLimits.policy = policy == "block" ? QUEUE_BLOCK : policy == "disconnect" ? QUEUE_DISCONNECT
+                                                                                               : QUEUE_DROP;
+            }
+            else if (arg == "--pre-message-bytes" && i + 1 < argc)
+                ChunkChain::limit = atol(argv[++i]);
+            else if (arg == "--pre-message-pool-bytes" && i + 1 < argc)
+                chunkPool.cap = atol(argv[++i]);
+            else if (arg == "--splice")
+                splice = true;
+            else if (arg == "--workers" && i + 1 < argc)
+                workers = std::clamp(atoi(argv[++i]), 1, 64);
+            else if (arg == "--shm-fd" && i + 1 < argc)
+            {
+                Api::shm = Api::Shm::attach(atoi(argv[++i]));
+                if (!Api::shm)
+                {
+                    fprintf(stderr, "Can not attach shared memory transport, staying on stdio\n");
+                    continue;
+                }
+                Api::out.ring = &Api::shm->out;
+            }
+            else
+                listen_port = atoi(argv[i]);
+        }
+        queueLimits.high = std::min(queueLimits.high, queueLimits.limit);
+        queueLimits.low = std::min(queueLimits.low, queueLimits.high);
+        queueLimits.blockLimit = std::max(queueLimits.blockLimit, queueLimits.limit);
+        if (unixPath)
+        {
+            fanout = new Api::Fanout(historyBytes);
+            Api::out.fanout = fanout;
+        }
+        // Logging never blocks socket callbacks from here on
+        if (!Api::logSink.start())
+        {
+            fprintf(stderr, "Can not open log file %s\n", Api::logSink.path.c_str());
+            return 1;
+        }
+
+        // Initialize server socket..
+        TCPServer<> tcpServer;
+        if (workers > 1 && io == "threads")
+            io = "epoll"; // Shards need a reactor
+        if (io != "threads")
+            startShards(io, workers, listen_port, splice);
+        else
+            listenThreads(tcpServer, listen_port);
 
         Api::log_info("TCP Server started on port {}", listen_port);
 
-        serve();
+        // Shards get loop threads of their own. The api input stays on this thread, a loop that blocks writing
+        // to the frontend must never be the one that reads from it
+        std::vector<std::thread> loops;
+        for (size_t k = 0; k < shards.size(); k++)
+            loops.emplace_back([k] { shards[k]->run(); });
+        if (replayPath)
+            replay(replayPath, replayFast);
+        else if (unixPath)
+            serveUnix(unixPath);
+        else
+            serve();
+        for (Reactor *shard : shards)
+            shard->stop();
+        for (std::thread &loop : loops)
+            loop.join();
+
+        Api::log_info("Output: {} frames in {} syscalls ({:.2f} frames/syscall), flushes size/delay/control {}/{}/{}",
+                      Api::out.frames.load(), Api::out.syscalls.load(), Api::out.framesPerSyscall(),
+                      Api::out.flushesSize.load(), Api::out.flushesDelay.load(), Api::out.flushesControl.load());
+        Api::log_info("Control lane: {} frames, head of line delay avg {:.1f} us, max {:.1f} us",
+                      Api::out.controlFrames.load(), Api::out.controlDelayAverageUs(), Api::out.controlDelayMaxNs / 1000.0);
 
         // Close the server before exiting the program.
         tcpServer.Close();
+        Api::logSink.stop();
+        if (Api::shm)
+        {
+            Api::out.flush();
+            Api::shm->out.close();
+        }
+        if (Api::capture)
+            Api::capture->close();
 
         return 0;
     }
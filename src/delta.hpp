@@ -1,6 +1,11 @@
 #pragma once
 
 #include "api.hpp"
+#include "log.hpp"
+#include "slotmap.hpp"
+#include "chunkpool.hpp"
+#include "reactor.hpp"
+#include "uring.hpp"
 #include <async-sockets/tcpsocket.hpp>
 #include <async-sockets/tcpserver.hpp>
 #include <mutex>
@@ -8,105 +13,209 @@
 #include <ranges>
 #include <format>
 #include <stdint.h>
+#include <atomic>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <signal.h>
 
 namespace Delta
 {
+    // Lifecycle of a connection
+    //     CONNECTING -> ACCEPTED            we dialed out, the socket connected
+    //     PENDING    -> ACCEPTED            a peer dialed in, the frontend sent ACCEPT_CONNECT
+    //     CONNECTING -> CLOSED              dialing failed
+    //     any        -> CLOSING -> CLOSED   whoever wins the move to CLOSING closes the socket, exactly once
+    enum ConnectionPhase : uint32_t
+    {
+        CONNECTING,
+        PENDING,
+        ACCEPTED,
+        CLOSING,
+        CLOSED
+    };
+
     class Connection
     {
     public: // Everything is public as per recommendation by Terry Davis
-        MagicType id;
-        std::mutex idLock;
-        bool accepted = false;
-        std::mutex acceptedLock;
-        bool deleted = false;
-        std::mutex deletedLock;
+        // [phase][id] in one word, so the hot paths are a single acquire load and there is no lock order to get wrong
+        std::atomic<uint32_t> state;
+        uint32_t handle = ~0u; // In the connection table, set by registerWith
         std::string ip;
         int port;
-        TCPSocket<> *socket;
-        std::array<char, Api::MAX_PRE_MESSAGE_LENGTH> preMessageBuffer;
-        char *preMessageBufferFreeSpace = preMessageBuffer.begin();
+        TCPSocket<> *socket = nullptr;
+        Peer *peer = nullptr;    // Instead of socket when reactors run the I/O
+        Reactor *shard = nullptr; // The one that owns peer
+        ChunkChain preMessageBuffer; // Until accepted, pooled chunks so only connections that wait pay for it
         std::mutex preMessageBufferLock;
+        std::atomic<bool> passThrough = false; // Accepted and the buffer handed over, received bytes skip it
 
         Connection(std::string ip, int port) // Constructor overload bad??
         {
+            state = pack(CONNECTING, 0);
             this->ip = ip.c_str();
             this->port = port;
         }
         Connection(TCPSocket<> *newSocket)
         {
+            state = pack(PENDING, 0);
             this->socket = newSocket;
             this->ip = socket->remoteAddress().c_str();
             this->port = socket->remotePort();
         }
+        Connection(Reactor *shard, Peer *peer, std::string ip, int port)
+        {
+            state = pack(PENDING, 0);
+            this->shard = shard;
+            this->peer = peer;
+            this->ip = ip;
+            this->port = port;
+        }
 
         ~Connection()
         {
-            deletedLock.lock();
-            if (!deleted)
-            {
-                deleted = true;
-                deletedLock.unlock();
-                socket->Close();
-            }
-            else
-                deletedLock.unlock();
+            if (beginClose())
+                closeSocket();
+        }
+
+        static constexpr uint32_t pack(ConnectionPhase phase, MagicType id) { return phase << 8 | id; }
+        MagicType getId() const { return state.load(std::memory_order_acquire) & 0xff; }
+        ConnectionPhase phase() const { return (ConnectionPhase)(state.load(std::memory_order_acquire) >> 8); }
+
+        void setId(MagicType id)
+        {
+            uint32_t current = state.load(std::memory_order_relaxed);
+            while (!state.compare_exchange_weak(current, (current & ~0xffu) | id, std::memory_order_acq_rel))
+                ;
+        }
+
+        // false if the connection was not in phase from
+        bool transition(ConnectionPhase from, ConnectionPhase to)
+        {
+            uint32_t current = state.load(std::memory_order_relaxed);
+            while (current >> 8 == from)
+                if (state.compare_exchange_weak(current, pack(to, current & 0xff), std::memory_order_acq_rel))
+                    return true;
+            return false;
+        }
+
+        // true for exactly one caller, that one closes the socket
+        bool beginClose()
+        {
+            uint32_t current = state.load(std::memory_order_relaxed);
+            while (current >> 8 < CLOSING)
+                if (state.compare_exchange_weak(current, pack(CLOSING, current & 0xff), std::memory_order_acq_rel))
+                    return true;
+            return false;
         }
 
         void createSocket();
-        void registerWith();
+        bool registerWith(int stripe = 0, int stripes = 1);
         void destory();
         void socketHandleClose(int errorCode);
+        void receive(const char *message, int length);
 
-        void socketSendMessage(char *messageBuffer, MessageLengthType messageLength) { Api::buffer_send_socket_all(socket, messageBuffer, messageLength); }
-
-        void setAccepted(bool newAccepted = true)
+        void closeSocket()
         {
-            acceptedLock.lock();
-            accepted = newAccepted;
-            acceptedLock.unlock();
+            if (peer)
+                shard->close(peer);
+            else if (socket)
+                socket->Close();
         }
 
-        bool isAccepted()
+        void socketSendMessage(const char *messageBuffer, FrameLengthType messageLength)
         {
-            bool acceptedCopy;
-            acceptedLock.lock();
-            acceptedCopy = accepted;
-            acceptedLock.unlock();
-            return acceptedCopy;
+            if (peer)
+                shard->send(peer, messageBuffer, messageLength);
+            else
+                Api::buffer_send_socket_all(socket, messageBuffer, messageLength);
         }
 
-        template <typename Func>
-        void iteratePreMessageBufferChunks(Func func)
+        // Straight from fd (memfd or file) to the peer, never through user space. Returns bytes sent,
+        // with reactors bytes queued, the shard's loop sends them
+        size_t socketSendFile(int fd, size_t length)
         {
-            preMessageBufferLock.lock();
-            int m = ((uintptr_t)preMessageBufferFreeSpace) / Api::MAX_MESSAGE_LENGTH;
-            char *iter = preMessageBuffer.begin();
-            for (int i = 0; i < m; i++)
+            if (peer)
             {
-                iter += i * Api::MAX_MESSAGE_LENGTH;
-                func(iter, Api::MAX_MESSAGE_LENGTH);
+                int copy = dup(fd); // The shard closes its copy once it is out
+                return copy >= 0 && shard->sendFile(peer, copy, length) ? length : 0;
             }
-            int n = ((uintptr_t)preMessageBufferFreeSpace) - m * Api::MAX_MESSAGE_LENGTH;
-            if (n > 0)
+            off_t offset = 0;
+            while ((size_t)offset < length)
             {
-                func(iter, n);
+                ssize_t m = sendfile(socket->fileDescriptor(), fd, &offset, length - offset);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m <= 0)
+                    break;
             }
-            preMessageBufferLock.unlock();
+            return offset;
+        }
+
+        void setAccepted(bool newAccepted = true)
+        {
+            if (newAccepted && transition(CONNECTING, ACCEPTED))
+                passThrough = true; // Dialed out, nothing was buffered
+            else
+                transition(CONNECTING, CLOSED);
+        }
+
+        bool isAccepted() const { return phase() == ACCEPTED; }
+
+        // PENDING -> ACCEPTED and the buffered messages handed over in order, both under the lock so nothing
+        // received meanwhile can overtake them. false if the connection was not pending
+        template <typename Func>
+        bool acceptPreMessageBuffer(Func func)
+        {
+            std::unique_lock<std::mutex> guard(preMessageBufferLock);
+            if (!transition(PENDING, ACCEPTED))
+                return false;
+            preMessageBuffer.forEach(func);
+            preMessageBuffer.release();
+            passThrough = true;
+            return true;
         }
 
-        void addToPreMessageBuffer(const char *buffer, int length)
+        // false when the per connection limit or the pool is exhausted, nothing is buffered then.
+        // Accepted in the meantime means the buffer was already handed over, the message goes straight out
+        bool addToPreMessageBuffer(const char *buffer, int length)
         {
-            preMessageBufferLock.lock();
-            int d = length - (preMessageBuffer.end() - preMessageBufferFreeSpace);
-            if (d > 0)
+            std::unique_lock<std::mutex> guard(preMessageBufferLock);
+            if (isAccepted())
             {
-                Api::log_info("Message buffer overflow from %s:%d by %d bytes", ip, port, d);
-                return;
+                Api::api_write_message(getId(), buffer, length);
+                return true;
             }
-            memcpy(preMessageBufferFreeSpace, buffer, length);
-            preMessageBufferFreeSpace += length;
-            preMessageBufferLock.unlock();
+            if (phase() >= CLOSING)
+                return true;
+            // We copy some arbitary bytes from a stranger on the internet into memory
+            // This should be safe though, operating systems store this in non-executable memory
+            // As long as we don't overflow the buffer, we should be fine
+            return preMessageBuffer.append(buffer, length);
+        }
+
+        void releasePreMessageBuffer()
+        {
+            std::unique_lock<std::mutex> guard(preMessageBufferLock);
+            preMessageBuffer.release();
         }
     };
 
+    // Frames from the frontend, wired up by Api::Dispatcher. They only get here once the schema validated them.
+    struct ApiHandler
+    {
+        static void connect(const Api::frame &frame);
+        static void disconnect(const Api::frame &frame);
+        static void accept_connect(const Api::frame &frame);
+        static void log_level(const Api::frame &frame);
+        static void fragment(const Api::frame &frame);
+        static void hello(const Api::frame &frame);
+        static void credit(const Api::frame &frame);
+        static void send_many(const Api::frame &frame);
+        static void attach(const Api::frame &frame);
+        static void send_fd(const Api::frame &frame);
+        static void data(const Api::frame &frame);
+        static void reject(const Api::frame &frame, const char *reason);
+    };
+
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+/* ** Fan out to several frontends **
+ *  In daemon mode (delta --listen-unix <path>) the outbound stream goes to every attached client instead of stdout.
+ *  The stream is one sequence of bytes, the sequence number of a frame is the offset of its first byte.
+ *  The last historySize bytes are kept, so a client that detached (or was dropped for being too slow) reattaches
+ *  with ATTACH [u64 sequence] and first gets everything it missed, then the live frames.
+ *  ATTACH_LIVE starts at the current position. Either way the client is answered with ATTACH [u64 sequence],
+ *  the sequence number of the next byte it receives. If that is not what it asked for, the history was too short.
+ *  Nothing about the TCP connections changes when clients come and go.
+ *  A HELLO is answered to the client that sent it, in between the shared frames and outside of the sequence.
+ *  It negotiates nothing shared, framing, batching and logs stay as delta was started.
+ */
+namespace Api
+{
+    const uint64_t ATTACH_LIVE = ~0ull;
+    const size_t FANOUT_DEFAULT_HISTORY_SIZE = 4 << 20;
+    const int FANOUT_MAX_CLIENTS = 16; // Served at once, more are refused
+
+    // Blocking unless the socket has a send timeout. false if the client has to go
+    inline bool sendv_all(int fd, struct iovec *iov, int iovcnt)
+    {
+        while (iovcnt > 0)
+        {
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            ssize_t m = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (m < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            while (iovcnt > 0 && (size_t)m >= iov->iov_len)
+            {
+                m -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0)
+            {
+                iov->iov_base = (char *)iov->iov_base + m;
+                iov->iov_len -= m;
+            }
+        }
+        return true;
+    }
+
+    class Fanout
+    {
+    public:
+        std::vector<char> history;
+        uint64_t sequence = 0; // Bytes written so far
+        std::vector<int> clients;
+        unsigned long dropped = 0;
+        std::mutex lock;
+
+        Fanout(size_t historySize = FANOUT_DEFAULT_HISTORY_SIZE) : history(historySize) {}
+
+        ssize_t writev(const struct iovec *iov, int iovcnt)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ssize_t total = 0;
+            for (int i = 0; i < iovcnt; i++)
+            {
+                remember((const char *)iov[i].iov_base, iov[i].iov_len);
+                total += iov[i].iov_len;
+            }
+            std::vector<struct iovec> copy;
+            for (size_t i = 0; i < clients.size();)
+            {
+                copy.assign(iov, iov + iovcnt); // sendv_all moves through it
+                if (sendv_all(clients[i], copy.data(), iovcnt))
+                {
+                    i++;
+                    continue;
+                }
+                // Too slow or gone. The reader sees EOF and closes, the client may reattach and resume
+                shutdown(clients[i], SHUT_RDWR);
+                clients.erase(clients.begin() + i);
+                dropped++;
+            }
+            return total;
+        }
+
+        // greeting encodes the ATTACH answer into dst and returns its size
+        template <typename Greeting>
+        uint64_t attach(int fd, uint64_t from, Greeting greeting)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            clients.erase(std::remove(clients.begin(), clients.end(), fd), clients.end());
+            uint64_t oldest = sequence > history.size() ? sequence - history.size() : 0;
+            if (from < oldest || from > sequence)
+                from = sequence;
+            char answer[64];
+            struct iovec iov[3] = {{answer, greeting(answer, from)}};
+            int iovcnt = 1;
+            size_t offset = from % history.size();
+            size_t missed = sequence - from;
+            size_t first = std::min(missed, history.size() - offset);
+            iov[iovcnt++] = {history.data() + offset, first};
+            iov[iovcnt++] = {history.data(), missed - first};
+            if (!sendv_all(fd, iov, iovcnt))
+            {
+                shutdown(fd, SHUT_RDWR);
+                return from;
+            }
+            clients.push_back(fd);
+            return from;
+        }
+
+        // A frame for one client only, like the answer to its HELLO. Goes in between broadcast frames and is
+        // not part of the sequence
+        bool reply(int fd, const char *buf, size_t len)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            struct iovec iov = {(void *)buf, len};
+            if (sendv_all(fd, &iov, 1))
+                return true;
+            shutdown(fd, SHUT_RDWR);
+            return false;
+        }
+
+        void detach(int fd)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            clients.erase(std::remove(clients.begin(), clients.end(), fd), clients.end());
+        }
+
+    private:
+        void remember(const char *buf, size_t len)
+        {
+            size_t size = history.size();
+            if (len > size) // Only the tail survives anyway
+            {
+                sequence += len - size;
+                buf += len - size;
+                len = size;
+            }
+            size_t offset = sequence % size;
+            size_t first = std::min(len, size - offset);
+            memcpy(history.data() + offset, buf, first);
+            memcpy(history.data(), buf + first, len - first);
+            sequence += len;
+        }
+    };
+}
@@ -0,0 +1,585 @@
+#pragma once
+
+#include "api.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* ** Logging **
+ *  Text mode (default): the message is formatted on the calling thread and sent as a LOG_INFO / LOG_ERROR frame.
+ *
+ *  Binary mode: nothing is formatted on the hot path. The first time a format string is used it is sent once
+ *  as LOG_FORMAT [id][format string], after that every call only sends LOG_RECORD [level][id][arguments]
+ *  with the raw argument bytes. The consumer (eta, or an offline tool reading a capture) turns records back
+ *  into text with LogDecoder whenever it actually wants to show them.
+ *
+ *  Each argument is a type byte followed by
+ *     ARG_INT, ARG_UINT, ARG_DOUBLE   8 bytes
+ *     ARG_BOOL, ARG_CHAR              1 byte
+ *     ARG_STRING                      2 byte length + bytes
+ *  Anything else is formatted with "{}" and sent as ARG_STRING.
+ *
+ *  Once logSink is started, callers only drop the record into a lock free queue and return, a background
+ *  thread does the writing. A full queue drops the record (counted) instead of blocking. The sink writes to
+ *     TARGET_API   frames on the API output, like synchronous logging
+ *     TARGET_FD    any fd, text lines or frames in binary mode
+ *     TARGET_FILE  like TARGET_FD but rotated to <path>.1 .. <path>.<keep> after rotateBytes
+ *  Records below logLevel are thrown away before any formatting happens.
+ */
+#define LogFormatIdType unsigned short
+
+namespace Api
+{
+    inline bool binaryLogs = false;
+
+    enum LogLevel : unsigned char
+    {
+        LEVEL_INFO,
+        LEVEL_ERROR,
+        LEVEL_OFF
+    };
+    inline std::atomic<unsigned char> logLevel = LEVEL_INFO;
+
+    inline bool log_enabled(MagicType log) { return (log == LOG_ERROR ? LEVEL_ERROR : LEVEL_INFO) >= logLevel.load(std::memory_order_relaxed); }
+
+    const int LOG_FORMAT_SLOTS = 4096;
+
+    enum LogArgType : unsigned char
+    {
+        ARG_INT,
+        ARG_UINT,
+        ARG_DOUBLE,
+        ARG_BOOL,
+        ARG_CHAR,
+        ARG_STRING
+    };
+
+    // Format string -> id, keyed by the address of the string literal.
+    // Lookups are lock free, only the first use of a format string takes the lock.
+    // Definitions (LOG_FORMAT) are written lazily by whoever writes the first record with an id,
+    // so they always land in front of it, whatever the target is.
+    class LogFormats
+    {
+    public:
+        std::atomic<const char *> keys[LOG_FORMAT_SLOTS] = {};
+        size_t lengths[LOG_FORMAT_SLOTS] = {};
+        std::atomic<unsigned char> defined[LOG_FORMAT_SLOTS] = {}; // 0 no, 1 being written, 2 yes
+        std::mutex lock;
+
+        // Returns the id, -1 if the table is full
+        int id(std::string_view fmt)
+        {
+            size_t slot = ((uintptr_t)fmt.data() >> 3) % LOG_FORMAT_SLOTS;
+            for (int i = 0; i < LOG_FORMAT_SLOTS; i++, slot = (slot + 1) % LOG_FORMAT_SLOTS)
+            {
+                const char *key = keys[slot].load(std::memory_order_acquire);
+                if (key == fmt.data())
+                    return slot;
+                if (key == nullptr)
+                    return publish(fmt);
+            }
+            return -1;
+        }
+
+        // Makes sure the definition of id went out through write(magic, buffer, length) before its first record
+        template <typename Write>
+        void define(LogFormatIdType id, Write write)
+        {
+            unsigned char state = defined[id].load(std::memory_order_acquire);
+            if (state == 2)
+                return;
+            if (state == 0 && defined[id].compare_exchange_strong(state, 1))
+            {
+                char definition[sizeof(LogFormatIdType) + 1024];
+                size_t n = std::min<size_t>(lengths[id], sizeof(definition) - sizeof(id));
+                memcpy(definition, &id, sizeof(id));
+                memcpy(definition + sizeof(id), keys[id].load(), n);
+                write(Magic::LOG_FORMAT, definition, sizeof(id) + n);
+                defined[id].store(2, std::memory_order_release);
+                return;
+            }
+            while (defined[id].load(std::memory_order_acquire) != 2) // Someone else is writing it right now
+                std::this_thread::yield();
+        }
+
+        // New target or a frontend that reattached, definitions have to be sent again
+        void undefineAll()
+        {
+            for (auto &state : defined)
+                state.store(0);
+        }
+
+    private:
+        int publish(std::string_view fmt)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            size_t slot = ((uintptr_t)fmt.data() >> 3) % LOG_FORMAT_SLOTS;
+            for (int i = 0; i < LOG_FORMAT_SLOTS; i++, slot = (slot + 1) % LOG_FORMAT_SLOTS)
+            {
+                const char *key = keys[slot].load(std::memory_order_relaxed);
+                if (key == fmt.data())
+                    return slot; // Someone else was faster
+                if (key != nullptr)
+                    continue;
+                lengths[slot] = fmt.size();
+                keys[slot].store(fmt.data(), std::memory_order_release);
+                return slot;
+            }
+            return -1;
+        }
+    };
+
+    inline LogFormats logFormats;
+
+    // Appends one argument to a record, returns the new size or 0 if it does not fit
+    template <typename T>
+    size_t log_pack(char *record, size_t size, size_t capacity, T &&arg)
+    {
+        typedef std::remove_cvref_t<T> U;
+        auto put = [&](LogArgType type, const void *bytes, size_t length) -> size_t
+        {
+            if (size + 1 + length > capacity)
+                return 0;
+            record[size] = type;
+            memcpy(record + size + 1, bytes, length);
+            return size + 1 + length;
+        };
+        if constexpr (std::is_same_v<U, bool>)
+            return put(ARG_BOOL, &arg, 1);
+        else if constexpr (std::is_same_v<U, char>)
+            return put(ARG_CHAR, &arg, 1);
+        else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>)
+        {
+            long long value = arg;
+            return put(ARG_INT, &value, sizeof(value));
+        }
+        else if constexpr (std::is_integral_v<U>)
+        {
+            unsigned long long value = arg;
+            return put(ARG_UINT, &value, sizeof(value));
+        }
+        else if constexpr (std::is_floating_point_v<U>)
+        {
+            double value = arg;
+            return put(ARG_DOUBLE, &value, sizeof(value));
+        }
+        else
+        {
+            std::string formatted;
+            std::string_view text;
+            if constexpr (std::is_convertible_v<const U &, std::string_view>)
+                text = arg;
+            else
+            {
+                formatted = std::format("{}", arg); // Enums and friends keep their formatter
+                text = formatted;
+            }
+            unsigned short length = std::min<size_t>(text.size(), capacity > size + 3 ? capacity - size - 3 : 0);
+            if (size + 3 > capacity)
+                return 0;
+            record[size] = ARG_STRING;
+            memcpy(record + size + 1, &length, sizeof(length));
+            memcpy(record + size + 3, text.data(), length);
+            return size + 3 + length;
+        }
+    }
+
+    // Packs a LOG_RECORD payload into record, returns its size or 0 if it does not fit
+    template <typename... T>
+    size_t log_record(char *record, [[maybe_unused]] size_t capacity, MagicType level, int id, T &&...args)
+    {
+        LogFormatIdType formatId = id;
+        record[0] = level;
+        memcpy(record + MAGIC_TYPE_SIZE, &formatId, sizeof(formatId));
+        size_t size = MAGIC_TYPE_SIZE + sizeof(formatId);
+        ((size = size ? log_pack(record, size, capacity, std::forward<T>(args)) : 0), ...);
+        return size;
+    }
+
+    inline LogFormatIdType log_record_id(const char *record)
+    {
+        LogFormatIdType id;
+        memcpy(&id, record + MAGIC_TYPE_SIZE, sizeof(id));
+        return id;
+    }
+
+    // ** Asynchronous sink **
+    const int LOG_QUEUE_SLOTS = 1024; // Power of two
+    const int LOG_SLOT_SIZE = 1024;   // Longer messages are truncated when logging asynchronously
+
+    enum LogTarget : unsigned char
+    {
+        TARGET_API,
+        TARGET_FD,
+        TARGET_FILE
+    };
+
+    typedef struct
+    {
+        std::atomic<size_t> sequence;
+        MagicType magic; // LOG_INFO, LOG_ERROR or LOG_RECORD
+        unsigned short length;
+        char data[LOG_SLOT_SIZE];
+    } log_slot;
+
+    class LogSink
+    {
+    public:
+        LogTarget target = TARGET_API;
+        int fd = -1;
+        std::string path;
+        size_t rotateBytes = 16 * 1024 * 1024;
+        int keep = 3;
+
+        std::atomic<unsigned long> written = 0;
+        std::atomic<unsigned long> dropped = 0;
+
+        log_slot *slots;
+        std::atomic<size_t> enqueuePos = 0;
+        size_t dequeuePos = 0; // Sink thread only
+        std::atomic<uint32_t> published = 0;
+        std::atomic<bool> sleeping = false;
+        std::atomic<bool> running = false;
+        std::thread thread;
+        size_t fileBytes = 0;
+
+        LogSink()
+        {
+            slots = new log_slot[LOG_QUEUE_SLOTS];
+            for (size_t i = 0; i < LOG_QUEUE_SLOTS; i++)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        ~LogSink()
+        {
+            stop();
+            delete[] slots;
+        }
+
+        // Target has to be configured before
+        bool start()
+        {
+            if (target == TARGET_FILE && !openFile())
+                return false;
+            logFormats.undefineAll();
+            running = true;
+            thread = std::thread([this] { run(); });
+            return true;
+        }
+
+        void stop()
+        {
+            if (!running.exchange(false))
+                return;
+            published.fetch_add(1);
+            published.notify_one();
+            thread.join();
+            if (target == TARGET_FILE && fd >= 0)
+                ::close(fd);
+        }
+
+        // Claims a slot, nullptr if the queue is full. The record is only seen by the sink after commit()
+        log_slot *claim()
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                log_slot *slot = &slots[pos & (LOG_QUEUE_SLOTS - 1)];
+                intptr_t diff = (intptr_t)slot->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+                if (diff == 0)
+                {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        return slot;
+                }
+                else if (diff < 0)
+                {
+                    dropped++;
+                    return nullptr;
+                }
+                else
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        void commit(log_slot *slot)
+        {
+            size_t pos = slot->sequence.load(std::memory_order_relaxed);
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            published.fetch_add(1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sleeping.load(std::memory_order_relaxed)) // Only pay for the wake when the sink is idle
+                published.notify_one();
+        }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                log_slot *slot = &slots[dequeuePos & (LOG_QUEUE_SLOTS - 1)];
+                if (slot->sequence.load(std::memory_order_acquire) == dequeuePos + 1)
+                {
+                    write(slot);
+                    slot->sequence.store(dequeuePos + LOG_QUEUE_SLOTS, std::memory_order_release);
+                    dequeuePos++;
+                    continue;
+                }
+                if (!running.load())
+                    break;
+                uint32_t seen = published.load(std::memory_order_acquire);
+                sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (slot->sequence.load(std::memory_order_acquire) != dequeuePos + 1 && running.load())
+                    published.wait(seen);
+                sleeping.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        void write(log_slot *slot)
+        {
+            if (target == TARGET_API)
+            {
+                if (slot->magic == Magic::LOG_RECORD)
+                    logFormats.define(log_record_id(slot->data), [](MagicType mag, const char *buf, size_t len)
+                                      { out.write(mag, buf, len); });
+                out.write(slot->magic, slot->data, slot->length);
+            }
+            else if (slot->magic == Magic::LOG_RECORD) // Frames, readable with LogDecoder
+            {
+                logFormats.define(log_record_id(slot->data), [this](MagicType mag, const char *buf, size_t len)
+                                  { fileBytes += writeFrame(mag, buf, len); });
+                fileBytes += writeFrame(slot->magic, slot->data, slot->length);
+            }
+            else
+            {
+                const char *level = slot->magic == Magic::LOG_ERROR ? "ERROR " : "INFO  ";
+                struct iovec iov[3] = {{(void *)level, 6}, {slot->data, slot->length}, {(void *)"\n", 1}};
+                fileBytes += writev_all(fd, iov, 3);
+            }
+            written++;
+            if (target == TARGET_FILE && fileBytes >= rotateBytes)
+                rotate();
+        }
+
+        // Always FIXED framing, whatever the API stream negotiated, so a file reads the same from start to end
+        int writeFrame(MagicType mag, const char *buf, size_t len)
+        {
+            char prefix[PREFIX_SIZE];
+            MessageLengthType length = len;
+            memcpy(prefix, &mag, MAGIC_TYPE_SIZE);
+            memcpy(prefix + MAGIC_TYPE_SIZE, &length, MESSAGE_LENGTH_TYPE_SIZE);
+            struct iovec iov[2] = {{prefix, PREFIX_SIZE}, {(void *)buf, len}};
+            return writev_all(fd, iov, 2);
+        }
+
+        bool openFile()
+        {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            fileBytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+            return true;
+        }
+
+        void rotate()
+        {
+            ::close(fd);
+            for (int i = keep - 1; i > 0; i--)
+                rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+            rename(path.c_str(), (path + ".1").c_str());
+            logFormats.undefineAll(); // Every file has to be decodable on its own
+            openFile();
+        }
+    };
+
+    inline LogSink logSink;
+
+    template <typename... T>
+    int log_binary(MagicType level, std::string_view fmt, T &&...args)
+    {
+        int id = logFormats.id(fmt);
+        if (id < 0)
+            return -1;
+        if (logSink.running.load(std::memory_order_relaxed))
+        {
+            log_slot *slot = logSink.claim();
+            if (!slot)
+                return -1;
+            size_t size = log_record(slot->data, LOG_SLOT_SIZE, level, id, std::forward<T>(args)...);
+            if (size == 0) // Too big for a slot, keep the format id so the consumer still sees something
+                size = MAGIC_TYPE_SIZE + sizeof(LogFormatIdType);
+            slot->magic = Magic::LOG_RECORD;
+            slot->length = size;
+            logSink.commit(slot);
+            return size;
+        }
+        thread_local char record[MAX_MESSAGE_LENGTH];
+        size_t size = log_record(record, sizeof(record), level, id, std::forward<T>(args)...);
+        if (size == 0) // Arguments did not fit
+            return -1;
+        logFormats.define(id, [](MagicType mag, const char *buf, size_t len)
+                          { out.write(mag, buf, len); });
+        return out.write(Magic::LOG_RECORD, record, size);
+    }
+
+    // Log calls
+    template <typename... T>
+    int log(MagicType log, std::format_string<T...> fmt, T &&...args)
+    {
+        if (!log_enabled(log))
+            return 0;
+        if (binaryLogs)
+            return log_binary(log, fmt.get(), std::forward<T>(args)...);
+        if (logSink.running.load(std::memory_order_relaxed))
+        {
+            log_slot *slot = logSink.claim();
+            if (!slot)
+                return -1;
+            std::format_to_n_result r = std::format_to_n(slot->data, LOG_SLOT_SIZE, fmt, std::forward<T>(args)...);
+            slot->magic = log;
+            slot->length = std::min<int>(r.size, LOG_SLOT_SIZE);
+            logSink.commit(slot);
+            return slot->length;
+        }
+        thread_local char str[MAX_MESSAGE_LENGTH];
+        std::format_to_n_result r = std::format_to_n(str, MAX_MESSAGE_LENGTH, fmt, std::forward<T>(args)...);
+        int n = std::min<int>(r.size, MAX_MESSAGE_LENGTH); // size is untruncated
+        return out.write(log, str, n);
+    }
+    template <typename... T>
+    auto log_info(std::format_string<T...> fmt, T &&...args) { return log(LOG_INFO, fmt, std::forward<T>(args)...); }
+    template <typename... T>
+    auto log_error(std::format_string<T...> fmt, T &&...args) { return log(LOG_ERROR, fmt, std::forward<T>(args)...); }
+
+    // Consumer side of binary logging. Feed it every LOG_FORMAT and LOG_RECORD frame, records come back as text.
+    class LogDecoder
+    {
+    public:
+        typedef std::variant<long long, unsigned long long, double, bool, char, std::string> argument;
+        std::vector<std::string> formats = std::vector<std::string>(LOG_FORMAT_SLOTS);
+
+        // Returns false for frames that are not binary logs or are malformed
+        bool feed(const frame &f, MagicType *level, std::string *text)
+        {
+            LogFormatIdType id;
+            if ((f.magic != Magic::LOG_FORMAT && f.magic != Magic::LOG_RECORD) || validate(OUTBOUND, f))
+                return false;
+            if (f.magic == Magic::LOG_FORMAT)
+            {
+                memcpy(&id, f.message, sizeof(id));
+                if (id >= LOG_FORMAT_SLOTS)
+                    return false;
+                formats[id].assign(f.message + sizeof(id), f.length - sizeof(id));
+                return true;
+            }
+            *level = f.message[0];
+            memcpy(&id, f.message + MAGIC_TYPE_SIZE, sizeof(id));
+            std::vector<argument> args;
+            if (id >= LOG_FORMAT_SLOTS || !unpack(f.message + MAGIC_TYPE_SIZE + sizeof(id), f.message + f.length, args))
+                return false;
+            *text = format(formats[id], args);
+            return true;
+        }
+
+        static bool unpack(const char *iter, const char *end, std::vector<argument> &args)
+        {
+            while (iter < end)
+            {
+                LogArgType type = (LogArgType)*iter++;
+                size_t length = type == ARG_BOOL || type == ARG_CHAR ? 1 : 8;
+                if (type == ARG_STRING)
+                {
+                    unsigned short n;
+                    if (end - iter < (ptrdiff_t)sizeof(n))
+                        return false;
+                    memcpy(&n, iter, sizeof(n));
+                    iter += sizeof(n);
+                    length = n;
+                }
+                if (type > ARG_STRING || end - iter < (ptrdiff_t)length)
+                    return false;
+                switch (type)
+                {
+                case ARG_INT:
+                    args.emplace_back(read<long long>(iter));
+                    break;
+                case ARG_UINT:
+                    args.emplace_back(read<unsigned long long>(iter));
+                    break;
+                case ARG_DOUBLE:
+                    args.emplace_back(read<double>(iter));
+                    break;
+                case ARG_BOOL:
+                    args.emplace_back((bool)*iter);
+                    break;
+                case ARG_CHAR:
+                    args.emplace_back(*iter);
+                    break;
+                case ARG_STRING:
+                    args.emplace_back(std::string(iter, length));
+                    break;
+                }
+                iter += length;
+            }
+            return true;
+        }
+
+        // Replacement fields are formatted one by one, so format specs still apply to the original types
+        static std::string format(std::string_view fmt, const std::vector<argument> &args)
+        {
+            std::string text;
+            size_t next = 0;
+            for (size_t i = 0; i < fmt.size(); i++)
+            {
+                char c = fmt[i];
+                if ((c == '{' || c == '}') && i + 1 < fmt.size() && fmt[i + 1] == c)
+                {
+                    text += c;
+                    i++;
+                    continue;
+                }
+                size_t close = c == '{' ? fmt.find('}', i) : std::string_view::npos;
+                if (close == std::string_view::npos)
+                {
+                    text += c;
+                    continue;
+                }
+                std::string_view field = fmt.substr(i + 1, close - i - 1);
+                std::string_view spec = field.substr(std::min(field.find(':'), field.size()));
+                size_t index = field.empty() || field[0] == ':' ? next++ : atoi(std::string(field).c_str());
+                if (index < args.size())
+                {
+                    std::string single = std::string("{") + std::string(spec) + "}";
+                    try
+                    {
+                        text += std::visit([&single](auto &value)
+                                           { return std::vformat(single, std::make_format_args(value)); },
+                                           args[index]);
+                    }
+                    catch (const std::format_error &)
+                    {
+                        text += fmt.substr(i, close - i + 1);
+                    }
+                }
+                else
+                    text += fmt.substr(i, close - i + 1);
+                i = close;
+            }
+            return text;
+        }
+
+    private:
+        template <typename T>
+        static T read(const char *iter)
+        {
+            T value;
+            memcpy(&value, iter, sizeof(value));
+            return value;
+        }
+    };
+}
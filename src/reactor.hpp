@@ -0,0 +1,629 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "api.hpp"
+#include "slotmap.hpp"
+
+/* ** Reactors **
+ *  delta owned socket I/O, the alternative to async-sockets' thread per socket (--io epoll, --io uring in uring.hpp).
+ *  A reactor runs accept, connect, read and write of every peer on the thread that calls run().
+ *  Sockets are non-blocking, every Peer keeps what the kernel did not take yet.
+ *  Callbacks run on the reactor thread inside an Epoch::Guard, so connections looked up there stay alive.
+ *  send(), sendFile() and close() may be called from any thread, they hand the work to the peer's loop.
+ *
+ *  Several reactors may run at once (--workers), each on its own thread with its own SO_REUSEPORT listener.
+ *  A peer belongs to the reactor that accepted or dialed it and only that loop does I/O on it.
+ */
+namespace Delta
+{
+    // What send() does with a message that does not fit into the peer's queue anymore
+    enum QueuePolicy
+    {
+        QUEUE_DROP,      // The message is lost, counted as dropped
+        QUEUE_BLOCK,     // Kept past the limit up to blockLimit, the frontend has to hold that connection's data until QUEUE_LOW
+        QUEUE_DISCONNECT // The peer is closed
+    };
+
+    struct QueueLimits
+    {
+        size_t limit = 4 << 20;  // Bytes per peer the kernel did not take yet
+        size_t high = 1 << 20;   // QUEUE_HIGH when reached
+        size_t low = 256 << 10;  // QUEUE_LOW when drained back to it
+        size_t blockLimit = 64 << 20; // QUEUE_BLOCK disconnects a peer that is this far behind
+        QueuePolicy policy = QUEUE_DROP;
+    };
+    inline QueueLimits queueLimits;
+
+    struct Peer
+    {
+        int fd = -1;
+        uint32_t token = ~0u;        // Whatever onAccept / connect was given, the connection handle
+        std::mutex lock;             // Guards pending
+        std::string pending;         // Accepted by send() but not by the kernel yet, from pendingHead on
+        size_t pendingHead = 0;      // Written already, see consume()
+        bool connecting = false;     // Waiting for a non-blocking connect
+        bool queued = false;         // A flush is posted to the loop, guarded by lock
+        bool high = false;           // Above the high watermark, QUEUE_HIGH went out
+        bool full = false;           // Hit the limit, QUEUE_FULL went out
+        size_t dropped = 0;
+        std::atomic<bool> closed = false;
+
+        struct Notice
+        {
+            Api::QueueState state;
+            size_t queued, dropped;
+        };
+        std::vector<Notice> notices;           // Watermarks crossed under lock, not delivered yet
+        std::atomic<bool> noticed = false;     // notices is not empty
+        std::mutex noticeLock;                 // Keeps deliveries in order, taken before lock
+
+        struct FileJob
+        {
+            int fd; // Owned, closed once it is out or the peer is gone
+            off_t offset;
+            size_t length;
+            std::string behind; // What send() got while this waited, it goes right after
+        };
+        std::deque<FileJob> files; // After pending, guarded by lock
+
+        ~Peer()
+        {
+            for (FileJob &job : files)
+                ::close(job.fd);
+        }
+    };
+
+    class Reactor
+    {
+    public:
+        // Returns the token for a new peer, ~0u to refuse it
+        std::function<uint32_t(Peer *peer, const sockaddr_in &address)> onAccept;
+        std::function<void(uint32_t token, int errorCode)> onConnect; // errorCode 0 on success
+        std::function<void(uint32_t token, const char *message, size_t length)> onData;
+        std::function<void(uint32_t token, int errorCode)> onClose;   // The peer is closed after this returns
+        // The send queue crossed a watermark, called after the peer's lock is released
+        std::function<void(uint32_t token, Api::QueueState state, size_t queued, size_t dropped)> onQueue;
+        // Takes the read off the reactor, recv(2) results. SPLICE_DECLINED to get the bytes through onData
+        std::function<ssize_t(uint32_t token, int fd)> onSplice;
+        static const ssize_t SPLICE_DECLINED = -2;
+
+        Epoch *epoch = nullptr; // Reclaims peers, share it with the connection table
+        bool reusePort = false; // SO_REUSEPORT, for several reactors listening on one port
+        std::thread::id loopThread; // Set by run()
+
+        virtual ~Reactor() {}
+        virtual bool listen(uint16_t port) = 0;
+        virtual Peer *connect(const std::string &host, uint16_t port, uint32_t token) = 0;
+        virtual void send(Peer *peer, const char *message, size_t length) = 0;
+        virtual void close(Peer *peer) = 0;
+        virtual void run() = 0;
+        virtual void stop() = 0;
+        // Runs fn on the loop, right away if this is the loop
+        virtual void post(std::function<void()> fn) = 0;
+
+        bool onLoop() const { return std::this_thread::get_id() == loopThread; }
+
+        // Straight from fd to the peer, in order with send(). The reactor takes fd over and its loop sends it
+        // with sendfile(2) as the socket takes it. false if the peer is closed, fd is closed then
+        virtual bool sendFile(Peer *peer, int fd, size_t length) = 0;
+
+    protected:
+        // Bytes accepted by send() that the kernel did not take yet
+        virtual size_t queuedLocked(Peer *peer) { return peer->pending.size() - peer->pendingHead + behindLocked(peer); }
+
+        // Bytes waiting behind files, files themselves do not count against the limits
+        static size_t behindLocked(Peer *peer)
+        {
+            size_t bytes = 0;
+            for (Peer::FileJob &job : peer->files)
+                bytes += job.behind.size();
+            return bytes;
+        }
+
+        // Where send() puts a message, behind the last file that is not out yet
+        static void appendLocked(Peer *peer, const char *message, size_t length)
+        {
+            if (peer->files.empty())
+                peer->pending.append(message, length);
+            else
+                peer->files.back().behind.append(message, length);
+        }
+
+        bool queueFileLocked(Peer *peer, int fd, size_t length)
+        {
+            if (peer->closed)
+            {
+                ::close(fd);
+                return false;
+            }
+            peer->files.push_back({fd, 0, length, {}});
+            return true;
+        }
+
+        // m more bytes of queue are written. The front is only cut off once it is half of the queue,
+        // so a queue that is written in small pieces costs linear time
+        static void consume(std::string &queue, size_t &head, size_t m)
+        {
+            head += m;
+            if (head == queue.size())
+            {
+                queue.clear();
+                head = 0;
+            }
+            else if (head >= queue.size() / 2)
+            {
+                queue.erase(0, head);
+                head = 0;
+            }
+        }
+
+        // Declared before the peer's lock is taken, delivers what crossed a watermark once it is released
+        struct Deliver
+        {
+            Reactor *reactor;
+            Peer *peer;
+            ~Deliver() { reactor->deliver(peer); }
+        };
+
+        void deliver(Peer *peer)
+        {
+            if (!peer->noticed)
+                return;
+            std::unique_lock<std::mutex> order(peer->noticeLock);
+            std::vector<Peer::Notice> notices;
+            {
+                std::unique_lock<std::mutex> guard(peer->lock);
+                notices.swap(peer->notices);
+                peer->noticed = false;
+            }
+            for (Peer::Notice &notice : notices)
+                if (onQueue)
+                    onQueue(peer->token, notice.state, notice.queued, notice.dropped);
+        }
+
+        // Before length more bytes go into the queue, false if the message must not
+        bool admitLocked(Peer *peer, size_t length)
+        {
+            size_t queued = queuedLocked(peer) + length;
+            if (queued > queueLimits.limit)
+            {
+                if (!peer->full)
+                {
+                    peer->full = peer->high = true;
+                    notify(peer, Api::QUEUE_FULL, queued - length);
+                }
+                bool keep = queueLimits.policy == QUEUE_BLOCK && queued <= queueLimits.blockLimit;
+                if (queueLimits.policy == QUEUE_DROP)
+                    peer->dropped += length;
+                else if (!keep) // QUEUE_DISCONNECT, or blocked for too long
+                    shutdown(peer->fd, SHUT_RDWR); // The loop sees it and closes
+                if (!keep)
+                    return false;
+            }
+            if (!peer->high && queued >= queueLimits.high)
+            {
+                peer->high = true;
+                notify(peer, Api::QUEUE_HIGH, queued);
+            }
+            return true;
+        }
+
+        // After the kernel took some
+        void drainedLocked(Peer *peer)
+        {
+            size_t queued = queuedLocked(peer);
+            if (peer->high && queued <= queueLimits.low)
+            {
+                peer->high = peer->full = false;
+                notify(peer, Api::QUEUE_LOW, queued);
+            }
+        }
+
+        void notify(Peer *peer, Api::QueueState state, size_t queued)
+        {
+            peer->notices.push_back({state, queued, peer->dropped});
+            peer->noticed = true;
+        }
+
+        enum Progress
+        {
+            SENT,
+            BLOCKED, // The socket is full
+            BROKEN   // errno tells
+        };
+
+        // The front file, on the loop once pending is out. What waited behind it becomes pending
+        Progress sendFrontFileLocked(Peer *peer)
+        {
+            Peer::FileJob &job = peer->files.front();
+            while ((size_t)job.offset < job.length)
+            {
+                ssize_t m = sendfile(peer->fd, job.fd, &job.offset, job.length - job.offset);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m < 0 && errno == EAGAIN)
+                    return BLOCKED;
+                if (m < 0)
+                    return BROKEN;
+                if (m == 0) // The file is shorter than announced
+                    break;
+            }
+            ::close(job.fd);
+            peer->pending = std::move(job.behind);
+            peer->pendingHead = 0;
+            peer->files.pop_front();
+            return SENT;
+        }
+
+        // Writes as much of pending and the files as the kernel takes, on the loop. false if the peer broke
+        bool drainLocked(Peer *peer)
+        {
+            while (true)
+            {
+                while (peer->pendingHead < peer->pending.size())
+                {
+                    ssize_t m = ::send(peer->fd, peer->pending.data() + peer->pendingHead, peer->pending.size() - peer->pendingHead, MSG_NOSIGNAL);
+                    if (m < 0 && errno == EINTR)
+                        continue;
+                    if (m < 0 && errno == EAGAIN)
+                    {
+                        drainedLocked(peer);
+                        return true;
+                    }
+                    if (m < 0)
+                        return false;
+                    consume(peer->pending, peer->pendingHead, m);
+                }
+                if (peer->files.empty())
+                    break;
+                Progress progress = sendFrontFileLocked(peer);
+                if (progress == BROKEN)
+                    return false;
+                if (progress == BLOCKED)
+                    break;
+            }
+            drainedLocked(peer);
+            return true;
+        }
+
+        int listenSocket(uint16_t port)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (reusePort)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            struct sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = INADDR_ANY;
+            address.sin_port = htons(port);
+            if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || ::listen(fd, SOMAXCONN) < 0)
+            {
+                if (fd >= 0)
+                    ::close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        static bool resolve(const std::string &host, uint16_t port, struct sockaddr_in &address)
+        {
+            struct addrinfo hints = {}, *result;
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0)
+                return false;
+            address = *(struct sockaddr_in *)result->ai_addr;
+            freeaddrinfo(result);
+            address.sin_port = htons(port);
+            return true;
+        }
+
+        // Non-blocking connect, -1 if it failed right away
+        static int connectSocket(const std::string &host, uint16_t port)
+        {
+            struct sockaddr_in address;
+            if (!resolve(host, port, address))
+                return -1;
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                return -1;
+            if (::connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)
+            {
+                ::close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        void retire(Peer *peer)
+        {
+            if (epoch)
+                epoch->retire([peer] { delete peer; });
+        }
+    };
+
+    class EpollReactor : public Reactor
+    {
+    public:
+        EpollReactor()
+        {
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+            wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            add(wakeFd, EPOLLIN, &wakeTag);
+        }
+
+        ~EpollReactor()
+        {
+            if (listenFd >= 0)
+                ::close(listenFd);
+            ::close(wakeFd);
+            ::close(epfd);
+        }
+
+        bool listen(uint16_t port) override
+        {
+            listenFd = listenSocket(port);
+            return listenFd >= 0 && add(listenFd, EPOLLIN | EPOLLET, &listenTag);
+        }
+
+        Peer *connect(const std::string &host, uint16_t port, uint32_t token) override
+        {
+            int fd = connectSocket(host, port);
+            if (fd < 0)
+                return nullptr;
+            Peer *peer = new Peer();
+            peer->fd = fd;
+            peer->token = token;
+            peer->connecting = true;
+            add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, peer);
+            return peer;
+        }
+
+        void send(Peer *peer, const char *message, size_t length) override
+        {
+            Deliver later{this, peer};
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (peer->closed || !admitLocked(peer, length))
+                return;
+            appendLocked(peer, message, length);
+            scheduleLocked(peer);
+        }
+
+        bool sendFile(Peer *peer, int fd, size_t length) override
+        {
+            Deliver later{this, peer};
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (!queueFileLocked(peer, fd, length))
+                return false;
+            scheduleLocked(peer);
+            return true;
+        }
+
+        void close(Peer *peer) override
+        {
+            {
+                std::unique_lock<std::mutex> guard(peer->lock);
+                if (peer->closed)
+                    return;
+                peer->closed = true;
+            }
+            post([this, peer]
+                 {
+                     epoll_ctl(epfd, EPOLL_CTL_DEL, peer->fd, nullptr);
+                     ::close(peer->fd);
+                     retire(peer); });
+        }
+
+        void post(std::function<void()> fn) override
+        {
+            if (onLoop())
+            {
+                fn();
+                return;
+            }
+            {
+                std::unique_lock<std::mutex> guard(postedLock);
+                posted.push_back(std::move(fn));
+            }
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+
+        void run() override
+        {
+            struct epoll_event events[256];
+            loopThread = std::this_thread::get_id();
+            running = true;
+            while (running)
+            {
+                int n = epoll_wait(epfd, events, 256, -1);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    break;
+                Epoch::Guard guard(*epoch);
+                for (int i = 0; i < n; i++)
+                {
+                    void *tag = events[i].data.ptr;
+                    if (tag == &wakeTag)
+                    {
+                        uint64_t value;
+                        while (read(wakeFd, &value, sizeof(value)) > 0)
+                            ;
+                        std::vector<std::function<void()>> calls;
+                        {
+                            std::unique_lock<std::mutex> guard(postedLock);
+                            calls.swap(posted);
+                        }
+                        for (auto &call : calls)
+                            call();
+                    }
+                    else if (tag == &listenTag)
+                        acceptAll();
+                    else
+                        handle((Peer *)tag, events[i].events);
+                }
+            }
+        }
+
+        void stop() override
+        {
+            running = false;
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+
+    private:
+        int epfd;
+        int wakeFd;
+        int listenFd = -1;
+        char wakeTag, listenTag; // Their addresses tell the special fds apart from peers
+        std::atomic<bool> running = false;
+        std::mutex postedLock;
+        std::vector<std::function<void()>> posted;
+        char buffer[64 * 1024];
+
+        // The loop writes what is queued, right away if this is the loop
+        void scheduleLocked(Peer *peer)
+        {
+            if (peer->connecting)
+                return;
+            if (onLoop())
+            {
+                if (!drainLocked(peer))
+                    shutdown(peer->fd, SHUT_RDWR); // The next event closes it
+                return;
+            }
+            if (peer->queued)
+                return;
+            // Another thread, the loop writes it. Posted under the lock so it runs before a close() of the peer
+            peer->queued = true;
+            post([this, peer]
+                 {
+                     Deliver later{this, peer};
+                     std::unique_lock<std::mutex> guard(peer->lock);
+                     peer->queued = false;
+                     if (!peer->closed && !drainLocked(peer))
+                         shutdown(peer->fd, SHUT_RDWR); });
+        }
+
+        bool add(int fd, uint32_t events, void *tag)
+        {
+            struct epoll_event event = {};
+            event.events = events;
+            event.data.ptr = tag;
+            return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == 0;
+        }
+
+        void acceptAll()
+        {
+            while (true)
+            {
+                struct sockaddr_in address;
+                socklen_t length = sizeof(address);
+                int fd = accept4(listenFd, (struct sockaddr *)&address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    return; // EAGAIN, or out of descriptors which the next edge retries
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                Peer *peer = new Peer();
+                peer->fd = fd;
+                peer->token = onAccept(peer, address);
+                if (peer->token == ~0u)
+                {
+                    ::close(fd);
+                    delete peer;
+                    continue;
+                }
+                add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, peer);
+            }
+        }
+
+        void handle(Peer *peer, uint32_t events)
+        {
+            if (peer->closed)
+                return;
+            if (peer->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                {
+                    std::unique_lock<std::mutex> guard(peer->lock);
+                    peer->connecting = false;
+                }
+                onConnect(peer->token, error);
+                if (error)
+                {
+                    close(peer);
+                    return;
+                }
+            }
+            if (events & EPOLLOUT)
+            {
+                Deliver later{this, peer};
+                std::unique_lock<std::mutex> guard(peer->lock);
+                if (!drainLocked(peer))
+                    events |= EPOLLERR;
+            }
+            if (events & EPOLLIN)
+            {
+                while (true)
+                {
+                    ssize_t m = onSplice ? onSplice(peer->token, peer->fd) : SPLICE_DECLINED;
+                    if (m == SPLICE_DECLINED && (m = recv(peer->fd, buffer, sizeof(buffer), 0)) > 0)
+                        onData(peer->token, buffer, m);
+                    if (m > 0)
+                        continue;
+                    if (m < 0 && errno == EINTR)
+                        continue;
+                    if (m < 0 && errno == EAGAIN)
+                        break;
+                    closePeer(peer, m < 0 ? errno : 0);
+                    return;
+                }
+            }
+            if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                closePeer(peer, error);
+            }
+        }
+
+        void closePeer(Peer *peer, int errorCode)
+        {
+            if (peer->closed)
+                return;
+            onClose(peer->token, errorCode);
+            close(peer);
+        }
+    };
+
+    inline std::vector<Reactor *> shards; // Empty = async-sockets. Connection slot % shards.size() picks the shard
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+/* ** Shared memory transport **
+ *  An optional replacement for the stdio pipe between eta and delta.
+ *  One memfd holds two single producer single consumer byte rings, one per direction.
+ *  The rings carry exactly the same Magic/length frames as the pipe, so everything above
+ *  (Output, Decoder) does not care which transport is used.
+ *
+ *  Nobody spins: a consumer that finds its ring empty flags itself as waiting and sleeps on a futex,
+ *  the producer only issues a wake syscall when that flag is set. Same thing for a producer on a full ring.
+ *
+ *  The frontend creates the memfd with Shm::create, spawns delta with the fd inherited and passes
+ *  --shm-fd <fd>. Without that flag delta stays on stdin/stdout.
+ */
+#define SHM_MAGIC 0x64656c74 // "delt"
+#define SHM_VERSION 1
+
+namespace Api
+{
+    const uint32_t SHM_DEFAULT_RING_SIZE = 1 << 20; // 1 MB per direction
+
+    typedef struct
+    {
+        alignas(64) std::atomic<uint64_t> tail; // Written by the producer
+        alignas(64) std::atomic<uint64_t> head; // Written by the consumer
+        alignas(64) std::atomic<uint32_t> dataSeq;
+        std::atomic<uint32_t> consumerWaiting;
+        std::atomic<uint32_t> spaceSeq;
+        std::atomic<uint32_t> producerWaiting;
+        std::atomic<uint32_t> closed;
+    } ring_header;
+
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t ringSize; // Power of two
+        uint32_t ringOffset[2];
+    } shm_header;
+
+    inline long futex(std::atomic<uint32_t> *word, int op, uint32_t val)
+    {
+        return syscall(SYS_futex, (uint32_t *)word, op, val, nullptr, nullptr, 0);
+    }
+
+    class Ring
+    {
+    public:
+        ring_header *header = nullptr;
+        char *data = nullptr;
+        uint64_t size = 0;
+
+        void init(ring_header *header, char *data, uint64_t size)
+        {
+            this->header = header;
+            this->data = data;
+            this->size = size;
+        }
+
+        // Blocks until everything is in the ring. Returns bytes written or -1 if the ring was closed
+        ssize_t writev(const struct iovec *iov, int iovcnt)
+        {
+            ssize_t total = 0;
+            for (int i = 0; i < iovcnt; i++)
+            {
+                const char *buf = (const char *)iov[i].iov_base;
+                size_t len = iov[i].iov_len;
+                while (len > 0)
+                {
+                    if (header->closed.load(std::memory_order_acquire))
+                        return -1;
+                    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+                    uint64_t free = size - (tail - header->head.load(std::memory_order_acquire));
+                    if (free == 0)
+                    {
+                        waitFor(header->spaceSeq, header->producerWaiting, [this, tail] { return header->head.load() + size != tail; });
+                        continue;
+                    }
+                    size_t n = std::min<uint64_t>(len, free);
+                    copyIn(tail, buf, n);
+                    header->tail.store(tail + n, std::memory_order_release);
+                    wake(header->dataSeq, header->consumerWaiting);
+                    buf += n;
+                    len -= n;
+                    total += n;
+                }
+            }
+            return total;
+        }
+
+        // Blocks until at least one byte is available. Returns bytes read, 0 once the ring is closed and drained
+        ssize_t read(char *buf, size_t len)
+        {
+            while (true)
+            {
+                uint64_t head = header->head.load(std::memory_order_relaxed);
+                uint64_t available = header->tail.load(std::memory_order_acquire) - head;
+                if (available > 0)
+                {
+                    size_t n = std::min<uint64_t>(len, available);
+                    copyOut(head, buf, n);
+                    header->head.store(head + n, std::memory_order_release);
+                    wake(header->spaceSeq, header->producerWaiting);
+                    return n;
+                }
+                if (header->closed.load(std::memory_order_acquire))
+                    return 0;
+                waitFor(header->dataSeq, header->consumerWaiting, [this, head] { return header->tail.load() != head || header->closed.load(); });
+            }
+        }
+
+        void close()
+        {
+            header->closed.store(1, std::memory_order_release);
+            header->dataSeq.fetch_add(1);
+            header->spaceSeq.fetch_add(1);
+            futex(&header->dataSeq, FUTEX_WAKE, INT32_MAX);
+            futex(&header->spaceSeq, FUTEX_WAKE, INT32_MAX);
+        }
+
+    private:
+        void copyIn(uint64_t pos, const char *buf, size_t n)
+        {
+            size_t offset = pos & (size - 1);
+            size_t first = std::min<size_t>(n, size - offset);
+            memcpy(data + offset, buf, first);
+            memcpy(data, buf + first, n - first);
+        }
+
+        void copyOut(uint64_t pos, char *buf, size_t n)
+        {
+            size_t offset = pos & (size - 1);
+            size_t first = std::min<size_t>(n, size - offset);
+            memcpy(buf, data + offset, first);
+            memcpy(buf + first, data, n - first);
+        }
+
+        // Only syscall when the other side announced it is asleep
+        void wake(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting.load(std::memory_order_relaxed))
+            {
+                seq.fetch_add(1, std::memory_order_release);
+                futex(&seq, FUTEX_WAKE, 1);
+            }
+        }
+
+        template <typename Ready>
+        void waitFor(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting, Ready ready)
+        {
+            uint32_t s = seq.load(std::memory_order_acquire);
+            waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready())
+                futex(&seq, FUTEX_WAIT, s);
+            waiting.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    class Shm
+    {
+    public:
+        int fd = -1;
+        void *map = nullptr;
+        size_t mapSize = 0;
+        Ring in;  // frontend -> delta
+        Ring out; // delta -> frontend
+
+        // Frontend side. The fd is left inheritable so it can be passed to delta via --shm-fd
+        static Shm *create(uint32_t ringSize = SHM_DEFAULT_RING_SIZE)
+        {
+            if (ringSize & (ringSize - 1))
+                return nullptr;
+            int fd = memfd_create("delta-api", MFD_ALLOW_SEALING);
+            if (fd < 0)
+                return nullptr;
+            size_t ringStride = (sizeof(ring_header) + ringSize + 4095) & ~(size_t)4095;
+            size_t size = 4096 + 2 * ringStride;
+            if (ftruncate(fd, size) < 0)
+            {
+                ::close(fd);
+                return nullptr;
+            }
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+            Shm *shm = new Shm();
+            shm->fd = fd;
+            shm->mapSize = size;
+            shm->map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (shm->map == MAP_FAILED)
+            {
+                delete shm;
+                return nullptr;
+            }
+            shm_header *header = (shm_header *)shm->map;
+            header->magic = SHM_MAGIC;
+            header->version = SHM_VERSION;
+            header->ringSize = ringSize;
+            header->ringOffset[0] = 4096;
+            header->ringOffset[1] = 4096 + ringStride;
+            for (int i = 0; i < 2; i++)
+                new ((char *)shm->map + header->ringOffset[i]) ring_header{};
+            shm->setup();
+            return shm;
+        }
+
+        // delta side
+        static Shm *attach(int fd)
+        {
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (size_t)st.st_size < 4096)
+                return nullptr;
+            Shm *shm = new Shm();
+            shm->fd = fd;
+            shm->mapSize = st.st_size;
+            shm->map = mmap(nullptr, shm->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (shm->map == MAP_FAILED)
+            {
+                delete shm;
+                return nullptr;
+            }
+            shm_header *header = (shm_header *)shm->map;
+            size_t ringEnd = (size_t)std::max(header->ringOffset[0], header->ringOffset[1]) + sizeof(ring_header) + header->ringSize;
+            if (header->magic != SHM_MAGIC || header->version != SHM_VERSION || ringEnd > shm->mapSize ||
+                header->ringSize == 0 || (header->ringSize & (header->ringSize - 1)))
+            {
+                delete shm;
+                return nullptr;
+            }
+            shm->setup();
+            return shm;
+        }
+
+        ~Shm()
+        {
+            if (map && map != MAP_FAILED)
+                munmap(map, mapSize);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+    private:
+        void setup()
+        {
+            shm_header *header = (shm_header *)map;
+            for (int i = 0; i < 2; i++)
+            {
+                char *base = (char *)map + header->ringOffset[i];
+                (i == 0 ? in : out).init((ring_header *)base, base + sizeof(ring_header), header->ringSize);
+            }
+        }
+    };
+
+    inline Shm *shm = nullptr; // Set when delta runs on the shared memory transport
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/* ** Slot map **
+ *  Fixed slots with stable indices, a slot keeps its index until the item is removed.
+ *  Every removal bumps the slot's generation, a handle is [generation][slot], so a handle to a removed
+ *  item never resolves to whatever reuses the slot. Freed slots are reused oldest first.
+ *
+ *  Lookups take no lock. Readers hold an Epoch::Guard while they use the item, removed items are
+ *  only deleted once every reader that could have seen them has left its epoch.
+ *  Inserts and removals are rare and serialized by a mutex.
+ */
+namespace Delta
+{
+    class Epoch
+    {
+    public:
+        static const int MAX_READERS = 512; // Threads alive at once that read, a thread per connection plus helpers and shards
+
+        struct alignas(64) Reader
+        {
+            std::atomic<uint64_t> epoch = 0; // 0 = not reading
+            std::atomic<bool> used = false;
+            int depth = 0; // Nested guards of the owning thread
+        };
+
+        std::atomic<uint64_t> global = 1;
+        Reader readers[MAX_READERS];
+        std::mutex retiredLock;
+        std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+
+        class Guard
+        {
+        public:
+            Guard(Epoch &epoch) : reader(epoch.reader())
+            {
+                if (reader->depth++ == 0)
+                    reader->epoch.store(epoch.global.load());
+            }
+            ~Guard()
+            {
+                if (--reader->depth == 0)
+                    reader->epoch.store(0, std::memory_order_release);
+            }
+
+        private:
+            Reader *reader;
+        };
+
+        // free runs once no reader can still hold what was unlinked before this call
+        void retire(std::function<void()> free)
+        {
+            std::unique_lock<std::mutex> guard(retiredLock);
+            retired.emplace_back(global.fetch_add(1), std::move(free));
+            collect();
+        }
+
+        void collect()
+        {
+            uint64_t oldest = UINT64_MAX;
+            for (Reader &reader : readers)
+            {
+                uint64_t epoch = reader.epoch.load();
+                if (epoch && epoch < oldest)
+                    oldest = epoch;
+            }
+            for (size_t i = 0; i < retired.size();)
+            {
+                if (retired[i].first < oldest)
+                {
+                    retired[i].second();
+                    retired[i] = std::move(retired.back());
+                    retired.pop_back();
+                }
+                else
+                    i++;
+            }
+        }
+
+    private:
+        // One Reader per thread, given back when the thread exits
+        Reader *reader()
+        {
+            struct Registration
+            {
+                Reader *reader = nullptr;
+                ~Registration()
+                {
+                    if (reader)
+                        reader->used.store(false);
+                }
+            };
+            thread_local Registration registration;
+            if (registration.reader)
+                return registration.reader;
+            for (Reader &reader : readers)
+            {
+                bool expected = false;
+                if (reader.used.compare_exchange_strong(expected, true))
+                    return registration.reader = &reader;
+            }
+            // A guard that protects nothing would let items be freed under the reader
+            fprintf(stderr, "Epoch: more than %d reading threads, raise MAX_READERS\n", MAX_READERS);
+            abort();
+        }
+    };
+
+    template <typename T, int N>
+    class SlotMap
+    {
+        static_assert(N <= 256, "The slot has to fit into the low byte of a handle");
+
+    public:
+        typedef uint32_t Handle; // [generation][slot]
+        static const Handle INVALID_HANDLE = ~0u;
+
+        struct Slot
+        {
+            std::atomic<T *> item = nullptr;
+            std::atomic<uint32_t> generation = 0;
+        };
+
+        Slot slots[N];
+        Epoch epoch;
+        std::atomic<int> count = 0;
+
+        SlotMap()
+        {
+            for (int slot = 0; slot < N; slot++)
+                freeSlots.push_back(slot);
+        }
+
+        static int slotOf(Handle handle) { return handle & 0xff; }
+        static Handle makeHandle(uint32_t generation, int slot) { return (generation & 0xffffff) << 8 | slot; }
+
+        // INVALID_HANDLE when full. With stripes only slots where slot % stripes == stripe are taken
+        Handle insert(T *item, int stripe = 0, int stripes = 1)
+        {
+            std::unique_lock<std::mutex> guard(writeLock);
+            auto free = std::find_if(freeSlots.begin(), freeSlots.end(), [=](int slot) { return slot % stripes == stripe; });
+            if (free == freeSlots.end())
+                return INVALID_HANDLE;
+            int slot = *free;
+            freeSlots.erase(free);
+            Handle handle = makeHandle(slots[slot].generation.load(), slot);
+            slots[slot].item.store(item);
+            count++;
+            return handle;
+        }
+
+        // Needs an Epoch::Guard around the use of the result
+        T *get(Handle handle)
+        {
+            int slot = slotOf(handle);
+            if (handle == INVALID_HANDLE || slot >= N)
+                return nullptr;
+            T *item = slots[slot].item.load(std::memory_order_acquire);
+            if (makeHandle(slots[slot].generation.load(std::memory_order_acquire), slot) != handle)
+                return nullptr;
+            return item;
+        }
+
+        // By slot alone, what the frontend addresses. Needs an Epoch::Guard as well
+        T *at(int slot) { return slot < N ? slots[slot].item.load(std::memory_order_acquire) : nullptr; }
+
+        Handle handleAt(int slot) { return makeHandle(slots[slot].generation.load(), slot); }
+
+        // Unlinks the item, free runs once no reader can see it anymore. false if the handle is stale
+        bool remove(Handle handle, std::function<void(T *)> free)
+        {
+            std::unique_lock<std::mutex> guard(writeLock);
+            int slot = slotOf(handle);
+            if (handle == INVALID_HANDLE || slot >= N || handleAt(slot) != handle)
+                return false;
+            T *item = slots[slot].item.exchange(nullptr);
+            if (!item)
+                return false;
+            slots[slot].generation.fetch_add(1);
+            freeSlots.push_back(slot);
+            count--;
+            guard.unlock();
+            epoch.retire([item, free] { free(item); });
+            return true;
+        }
+
+    private:
+        std::mutex writeLock;
+        std::deque<int> freeSlots;
+    };
+}
@@ -0,0 +1,581 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <vector>
+#include "reactor.hpp"
+
+/* ** io_uring reactor **
+ *  delta --io uring, same callbacks and Peer semantics as the epoll reactor, less syscalls per message.
+ *    - One multishot accept on the listener, one multishot recv per peer. Received bytes land in a ring of
+ *      provided buffers (buffer group 0) and go back to the kernel as soon as onData returned.
+ *    - Peers live in the registered file table, recv and send address them by slot.
+ *    - send() only queues, the loop submits one SEND per dirty peer and everything of one iteration
+ *      goes to the kernel with a single io_uring_enter.
+ *    - Calls from other threads are posted to the loop and wake it through an eventfd read.
+ *  Raw syscalls, liburing is not needed. Needs Linux 5.19 (provided buffer rings), ok() is false otherwise.
+ */
+namespace Delta
+{
+    class UringReactor : public Reactor
+    {
+    public:
+        static const unsigned RING_ENTRIES = 256;
+        static const unsigned FILES = 1024;        // Registered file slots, above MAX_CONNECTIONS for refused peers
+        static const unsigned BUFFER_COUNT = 512;  // Provided receive buffers, a power of 2
+        static const unsigned BUFFER_SIZE = 16384;
+        static const uint16_t BUFFER_GROUP = 0;
+
+        struct UringPeer : Peer
+        {
+            int slot = -1;                     // In the registered file table
+            struct sockaddr_in address;        // connect reads it until it completes
+            std::string inflight;              // Handed to a SEND from inflightHead on, guarded by lock
+            size_t inflightHead = 0;
+            std::atomic<int> refs = 0;         // Operations and posted calls that still use the peer
+            bool released = false;             // fd is gone, freed once refs drops to 0
+            bool retired = false;
+            bool polling = false;              // Waiting for room for a file, guarded by lock
+        };
+
+        UringReactor()
+        {
+            struct io_uring_params params = {};
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+            params.cq_entries = RING_ENTRIES * 4;
+            ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+            if (ringFd < 0)
+                return;
+            sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+            cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sqSize = cqSize = std::max(sqSize, cqSize);
+            sqRing = (char *)mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            cqRing = params.features & IORING_FEAT_SINGLE_MMAP
+                         ? sqRing
+                         : (char *)mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            sqes = (struct io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            sqEntries = params.sq_entries;
+            if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+                return;
+            sqHead = (unsigned *)(sqRing + params.sq_off.head);
+            sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+            sqMask = *(unsigned *)(sqRing + params.sq_off.ring_mask);
+            sqArray = (unsigned *)(sqRing + params.sq_off.array);
+            cqHead = (unsigned *)(cqRing + params.cq_off.head);
+            cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+            cqMask = *(unsigned *)(cqRing + params.cq_off.ring_mask);
+            cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+            std::vector<int> files(FILES, -1); // Sparse, filled by updates
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, files.data(), FILES) < 0)
+                return;
+            for (int slot = FILES - 1; slot >= 0; slot--)
+                freeSlots.push_back(slot);
+
+            bufferRingSize = BUFFER_COUNT * sizeof(struct io_uring_buf);
+            bufferRing = (struct io_uring_buf_ring *)mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            buffers = (char *)mmap(nullptr, BUFFER_COUNT * BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (bufferRing == MAP_FAILED || buffers == MAP_FAILED)
+                return;
+            struct io_uring_buf_reg reg = {};
+            reg.ring_addr = (uint64_t)bufferRing;
+            reg.ring_entries = BUFFER_COUNT;
+            reg.bgid = BUFFER_GROUP;
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                return;
+            for (unsigned bid = 0; bid < BUFFER_COUNT; bid++)
+                recycle(bid);
+
+            wakeFd = eventfd(0, EFD_CLOEXEC);
+            armWake();
+            ready = true;
+        }
+
+        ~UringReactor()
+        {
+            if (listenFd >= 0)
+                ::close(listenFd);
+            if (wakeFd >= 0)
+                ::close(wakeFd);
+            if (buffers && buffers != MAP_FAILED)
+                munmap(buffers, BUFFER_COUNT * BUFFER_SIZE);
+            if (bufferRing && bufferRing != MAP_FAILED)
+                munmap(bufferRing, bufferRingSize);
+            if (sqes && sqes != MAP_FAILED)
+                munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+            if (cqRing && cqRing != MAP_FAILED && cqRing != sqRing)
+                munmap(cqRing, cqSize);
+            if (sqRing && sqRing != MAP_FAILED)
+                munmap(sqRing, sqSize);
+            if (ringFd >= 0)
+                ::close(ringFd);
+        }
+
+        // false if the kernel has no (recent enough) io_uring, use another reactor then
+        bool ok() const { return ready; }
+
+        bool listen(uint16_t port) override
+        {
+            listenFd = listenSocket(port);
+            if (listenFd < 0)
+                return false;
+            post([this] { armAccept(); });
+            return true;
+        }
+
+        Peer *connect(const std::string &host, uint16_t port, uint32_t token) override
+        {
+            UringPeer *peer = new UringPeer();
+            peer->token = token;
+            peer->connecting = true;
+            if (!resolve(host, port, peer->address) || (peer->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+                (peer->slot = attachFile(peer->fd)) < 0)
+            {
+                if (peer->fd >= 0)
+                    ::close(peer->fd);
+                delete peer;
+                return nullptr;
+            }
+            peer->refs++;
+            post([this, peer] // The posted reference becomes the CONNECT's
+                 {
+                     struct io_uring_sqe *sqe = prepare(IORING_OP_CONNECT, peer->slot, peer, OP_CONNECT);
+                     sqe->flags = IOSQE_FIXED_FILE;
+                     sqe->addr = (uint64_t)&peer->address;
+                     sqe->off = sizeof(peer->address); });
+            return peer;
+        }
+
+        void send(Peer *base, const char *message, size_t length) override
+        {
+            UringPeer *peer = (UringPeer *)base;
+            Deliver later{this, peer};
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (peer->closed || !admitLocked(peer, length))
+                return;
+            appendLocked(peer, message, length);
+            markDirty(peer, guard);
+        }
+
+        bool sendFile(Peer *base, int fd, size_t length) override
+        {
+            UringPeer *peer = (UringPeer *)base;
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (!queueFileLocked(peer, fd, length))
+                return false;
+            markDirty(peer, guard);
+            return true;
+        }
+
+        void close(Peer *base) override
+        {
+            UringPeer *peer = (UringPeer *)base;
+            if (peer->closed.exchange(true))
+                return;
+            peer->refs++;
+            post([this, peer]
+                 {
+                     peer->refs--;
+                     shutdown(peer->fd, SHUT_RDWR); // Ends the multishot recv and any SEND
+                     detachFile(peer->slot);
+                     ::close(peer->fd);
+                     peer->released = true;
+                     release(peer); });
+        }
+
+        void run() override
+        {
+            loopThread = std::this_thread::get_id();
+            running = true;
+            while (running)
+                step();
+        }
+
+        void stop() override
+        {
+            running = false;
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+
+    private:
+        enum Op : uint64_t
+        {
+            OP_ACCEPT,
+            OP_WAKE,
+            OP_RECV,
+            OP_SEND,
+            OP_CONNECT,
+            OP_WRITABLE // Room for a file that did not fit
+        };
+
+        int ringFd = -1;
+        int listenFd = -1;
+        int wakeFd = -1;
+        bool ready = false;
+        size_t sqSize, cqSize;
+        char *sqRing = nullptr, *cqRing = nullptr;
+        struct io_uring_sqe *sqes = nullptr;
+        unsigned sqEntries, sqMask, cqMask;
+        unsigned *sqHead, *sqTail, *sqArray, *cqHead, *cqTail;
+        struct io_uring_cqe *cqes;
+        unsigned toSubmit = 0;
+        struct io_uring_buf_ring *bufferRing = nullptr;
+        size_t bufferRingSize;
+        char *buffers = nullptr;
+        uint16_t bufferTail = 0;
+        uint64_t wakeValue;
+
+        std::mutex slotsLock;
+        std::vector<int> freeSlots;
+        std::mutex postedLock;
+        std::vector<std::function<void()>> posted;
+        std::vector<UringPeer *> dirty; // Peers with pending bytes, loop only
+        std::atomic<bool> running = false;
+
+    public:
+        void post(std::function<void()> fn) override
+        {
+            if (onLoop())
+            {
+                fn();
+                return;
+            }
+            {
+                std::unique_lock<std::mutex> guard(postedLock);
+                posted.push_back(std::move(fn));
+            }
+            uint64_t one = 1;
+            write(wakeFd, &one, sizeof(one));
+        }
+
+    protected:
+        size_t queuedLocked(Peer *peer) override
+        {
+            UringPeer *uring = (UringPeer *)peer;
+            return peer->pending.size() - peer->pendingHead + uring->inflight.size() - uring->inflightHead + behindLocked(peer);
+        }
+
+    private:
+        int attachFile(int fd)
+        {
+            std::unique_lock<std::mutex> guard(slotsLock);
+            if (freeSlots.empty())
+                return -1;
+            int slot = freeSlots.back();
+            struct io_uring_files_update update = {(uint32_t)slot, 0, (uint64_t)&fd};
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 1)
+                return -1;
+            freeSlots.pop_back();
+            return slot;
+        }
+
+        void detachFile(int slot)
+        {
+            int none = -1;
+            struct io_uring_files_update update = {(uint32_t)slot, 0, (uint64_t)&none};
+            syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+            std::unique_lock<std::mutex> guard(slotsLock);
+            freeSlots.push_back(slot);
+        }
+
+        void recycle(uint16_t bid)
+        {
+            // Not bufferRing->bufs, C++ pads the flexible array behind an empty struct
+            struct io_uring_buf *buf = (struct io_uring_buf *)bufferRing + (bufferTail & (BUFFER_COUNT - 1));
+            buf->addr = (uint64_t)(buffers + (size_t)bid * BUFFER_SIZE);
+            buf->len = BUFFER_SIZE;
+            buf->bid = bid;
+            __atomic_store_n(&bufferRing->tail, ++bufferTail, __ATOMIC_RELEASE);
+        }
+
+        // Next free SQE, submits what is queued when the ring is full
+        struct io_uring_sqe *prepare(uint8_t opcode, int fd, void *data, Op op)
+        {
+            if (toSubmit == sqEntries)
+                enter(0);
+            unsigned tail = *sqTail;
+            unsigned index = tail & sqMask;
+            struct io_uring_sqe *sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->user_data = (uint64_t)data | op;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            toSubmit++;
+            return sqe;
+        }
+
+        void enter(unsigned waitFor)
+        {
+            while (true)
+            {
+                int m = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (m >= 0)
+                {
+                    toSubmit -= std::min<unsigned>(m, toSubmit);
+                    return;
+                }
+                if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    return;
+                if (!waitFor && errno != EINTR)
+                    return;
+            }
+        }
+
+        void armAccept()
+        {
+            struct io_uring_sqe *sqe = prepare(IORING_OP_ACCEPT, listenFd, nullptr, OP_ACCEPT);
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        }
+
+        void armWake()
+        {
+            struct io_uring_sqe *sqe = prepare(IORING_OP_READ, wakeFd, nullptr, OP_WAKE);
+            sqe->addr = (uint64_t)&wakeValue;
+            sqe->len = sizeof(wakeValue);
+        }
+
+        void armRecv(UringPeer *peer)
+        {
+            struct io_uring_sqe *sqe = prepare(IORING_OP_RECV, peer->slot, peer, OP_RECV);
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->buf_group = BUFFER_GROUP;
+            peer->refs++;
+        }
+
+        // The loop submits the peer's queue in its next round. Called with the peer's lock, releases it
+        void markDirty(UringPeer *peer, std::unique_lock<std::mutex> &guard)
+        {
+            if (peer->queued)
+                return;
+            peer->queued = true;
+            peer->refs++;
+            guard.unlock();
+            post([this, peer] { dirty.push_back(peer); }); // Holds the reference until it is submitted
+        }
+
+        // Hands pending to a SEND unless one is in flight already. Files at the front go out right here with
+        // sendfile(2) as far as the socket takes them, a POLL waits for room for the rest
+        void submitSend(UringPeer *peer)
+        {
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (peer->closed || peer->connecting || peer->polling || !peer->inflight.empty())
+                return;
+            while (peer->pending.empty() && !peer->files.empty())
+            {
+                Progress progress = sendFrontFileLocked(peer);
+                if (progress == BROKEN)
+                {
+                    int error = errno;
+                    guard.unlock();
+                    closePeer(peer, error);
+                    return;
+                }
+                if (progress == BLOCKED)
+                {
+                    peer->polling = true;
+                    struct io_uring_sqe *sqe = prepare(IORING_OP_POLL_ADD, peer->slot, peer, OP_WRITABLE);
+                    sqe->flags = IOSQE_FIXED_FILE;
+                    sqe->poll32_events = POLLOUT;
+                    peer->refs++;
+                    return;
+                }
+            }
+            if (peer->pending.empty())
+                return;
+            peer->inflight.swap(peer->pending);
+            guard.unlock();
+            struct io_uring_sqe *sqe = prepare(IORING_OP_SEND, peer->slot, peer, OP_SEND);
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->addr = (uint64_t)peer->inflight.data();
+            sqe->len = peer->inflight.size();
+            sqe->msg_flags = MSG_NOSIGNAL;
+            peer->refs++;
+        }
+
+        void release(UringPeer *peer)
+        {
+            if (!peer->released || peer->refs > 0 || peer->retired)
+                return;
+            peer->retired = true;
+            if (epoch)
+                epoch->retire([peer] { delete peer; });
+        }
+
+        // One round: posted calls and dirty peers out, at least one completion in
+        void step()
+        {
+            std::vector<std::function<void()>> calls;
+            {
+                std::unique_lock<std::mutex> guard(postedLock);
+                calls.swap(posted);
+            }
+            Epoch::Guard guard(*epoch);
+            for (auto &call : calls)
+                call();
+            for (UringPeer *peer : dirty)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(peer->lock);
+                    peer->queued = false;
+                }
+                submitSend(peer);
+                peer->refs--;
+                release(peer);
+            }
+            dirty.clear();
+            enter(1);
+            while (true)
+            {
+                unsigned head = *cqHead;
+                if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+                    break;
+                struct io_uring_cqe cqe = cqes[head & cqMask];
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                complete(cqe);
+            }
+        }
+
+        void complete(const struct io_uring_cqe &cqe)
+        {
+            Op op = (Op)(cqe.user_data & 7);
+            UringPeer *peer = (UringPeer *)(cqe.user_data & ~7ull);
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            switch (op)
+            {
+            case OP_ACCEPT:
+                if (cqe.res >= 0)
+                    accepted(cqe.res);
+                if (!more && running)
+                    armAccept();
+                break;
+            case OP_WAKE:
+                armWake();
+                break;
+            case OP_CONNECT:
+            {
+                {
+                    std::unique_lock<std::mutex> guard(peer->lock);
+                    peer->connecting = false;
+                }
+                peer->refs--;
+                if (!peer->closed)
+                    onConnect(peer->token, cqe.res < 0 ? -cqe.res : 0);
+                if (cqe.res < 0)
+                    close(peer);
+                else if (!peer->closed)
+                {
+                    armRecv(peer);
+                    submitSend(peer); // What was sent while connecting
+                }
+                release(peer);
+                break;
+            }
+            case OP_RECV:
+                received(peer, cqe, more);
+                break;
+            case OP_SEND:
+                sent(peer, cqe.res);
+                break;
+            case OP_WRITABLE:
+            {
+                peer->refs--;
+                {
+                    std::unique_lock<std::mutex> guard(peer->lock);
+                    peer->polling = false;
+                }
+                submitSend(peer);
+                release(peer);
+                break;
+            }
+            }
+        }
+
+        void accepted(int fd)
+        {
+            struct sockaddr_in address = {};
+            socklen_t length = sizeof(address);
+            getpeername(fd, (struct sockaddr *)&address, &length);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            UringPeer *peer = new UringPeer();
+            peer->fd = fd;
+            peer->slot = attachFile(fd);
+            if (peer->slot < 0 || (peer->token = onAccept(peer, address)) == ~0u)
+            {
+                if (peer->slot >= 0)
+                    detachFile(peer->slot);
+                ::close(fd);
+                delete peer;
+                return;
+            }
+            armRecv(peer);
+        }
+
+        void received(UringPeer *peer, const struct io_uring_cqe &cqe, bool more)
+        {
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+            {
+                uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe.res > 0 && !peer->closed)
+                    onData(peer->token, buffers + (size_t)bid * BUFFER_SIZE, cqe.res);
+                recycle(bid);
+            }
+            if (more)
+                return;
+            peer->refs--;
+            if (!peer->closed && (cqe.res > 0 || cqe.res == -ENOBUFS)) // Out of buffers for a moment, they are back now
+                armRecv(peer);
+            else if (!peer->closed)
+                closePeer(peer, cqe.res < 0 ? -cqe.res : 0);
+            release(peer);
+        }
+
+        void sent(UringPeer *peer, int result)
+        {
+            peer->refs--;
+            Deliver later{this, peer};
+            std::unique_lock<std::mutex> guard(peer->lock);
+            if (result < 0 || peer->closed)
+            {
+                peer->inflight.clear();
+                peer->inflightHead = 0;
+                guard.unlock();
+                if (!peer->closed)
+                    closePeer(peer, -result);
+                release(peer);
+                return;
+            }
+            consume(peer->inflight, peer->inflightHead, result);
+            drainedLocked(peer);
+            if (!peer->inflight.empty()) // Short send, the rest goes first
+            {
+                struct io_uring_sqe *sqe = prepare(IORING_OP_SEND, peer->slot, peer, OP_SEND);
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->addr = (uint64_t)peer->inflight.data() + peer->inflightHead;
+                sqe->len = peer->inflight.size() - peer->inflightHead;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                peer->refs++;
+                return;
+            }
+            guard.unlock();
+            submitSend(peer);
+        }
+
+        void closePeer(UringPeer *peer, int errorCode)
+        {
+            if (peer->closed)
+                return;
+            onClose(peer->token, errorCode);
+            close(peer);
+        }
+    };
+}
@@ -0,0 +1,236 @@
+#include "log.hpp"
+#include "chunkpool.hpp"
+#include "slotmap.hpp"
+#include <sys/mman.h>
+
+/* Behaviour tests for the codec, reassembly, pre-message chunks and the slot map
+ *  Every failed check prints its line, the exit code is the number of failures.
+ */
+
+#define CHECK(cond) ((cond) ? (void)0 : (void)(Test::failures++, fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond)))
+
+namespace Test
+{
+    int failures = 0;
+
+    std::string pattern(size_t length)
+    {
+        std::string text(length, 0);
+        for (size_t i = 0; i < length; i++)
+            text[i] = (char)(i * 31 + i / 251);
+        return text;
+    }
+
+    // All frames in fd from the start, decoded the way serve() does it
+    template <typename Func>
+    void decodeAll(int fd, Func onFrame)
+    {
+        lseek(fd, 0, SEEK_SET);
+        Api::Decoder decoder(fd, Api::OUTBOUND);
+        Api::frame frame;
+        while (decoder.fill() > 0)
+            while (decoder.next(frame))
+                onFrame(frame);
+        CHECK(!decoder.error);
+        CHECK(decoder.pending() == 0);
+    }
+
+    void varint()
+    {
+        Api::frameMode = Api::VARINT;
+        struct
+        {
+            FrameLengthType length;
+            int prefix;
+        } cases[] = {{0, 2}, {1, 2}, {127, 2}, {128, 3}, {16383, 3}, {16384, 4}, {Api::VARINT_MAX_MESSAGE_LENGTH, 4}};
+        for (auto [length, prefix] : cases)
+        {
+            char buf[Api::MAX_PREFIX_SIZE];
+            CHECK(Api::encode_prefix(buf, 7, length) == prefix);
+            MagicType mag;
+            FrameLengthType decoded;
+            CHECK(Api::decode_prefix(buf, prefix, &mag, &decoded) == prefix);
+            CHECK(mag == 7 && decoded == length);
+            CHECK(Api::decode_prefix(buf, prefix - 1, &mag, &decoded) == 0); // Needs the rest
+        }
+        char overlong[] = {7, (char)0x80, (char)0x80, (char)0x80, 0};
+        MagicType mag;
+        FrameLengthType decoded;
+        CHECK(Api::decode_prefix(overlong, sizeof(overlong), &mag, &decoded) == -1);
+
+        // The biggest frame goes through whole, one above is split
+        std::string message = pattern(Api::VARINT_MAX_MESSAGE_LENGTH + 1);
+        int fd = memfd_create("varint", 0);
+        Api::Output output(fd);
+        output.writeMessage(3, message.data(), Api::VARINT_MAX_MESSAGE_LENGTH);
+        output.writeMessage(3, message.data(), message.size());
+        output.flush();
+        std::vector<FrameLengthType> lengths;
+        decodeAll(fd, [&](const Api::frame &f)
+                  { lengths.push_back(f.length); });
+        CHECK(lengths.size() == 3);
+        CHECK(lengths.size() == 3 && lengths[0] == Api::VARINT_MAX_MESSAGE_LENGTH);
+        CHECK(lengths.size() == 3 && lengths[1] + lengths[2] == message.size() + Api::MAGIC_TYPE_SIZE);
+        close(fd);
+        Api::frameMode = Api::FIXED;
+    }
+
+    // make_buffer and Output split the same way, the Reassembler puts it back together
+    void fragments()
+    {
+        size_t max = Api::max_message_length();
+        for (size_t length : {max, max + 1, max + 2, 2 * max - 2, 2 * max - 1, 2 * max, 3 * max + 10})
+        {
+            std::string message = pattern(length);
+            int fd = memfd_create("fragments", 0);
+            Api::buffer *buffer = Api::make_buffer(5, message.data(), length);
+            CHECK(Api::buffer_write(fd, buffer) > 0);
+            Api::Output output(fd);
+            output.writeMessage(5, message.data(), length);
+            output.flush();
+
+            Api::Reassembler reassembler;
+            std::string got[2];
+            int messages = 0;
+            size_t frames = 0;
+            decodeAll(fd, [&](const Api::frame &f)
+                      { frames++;
+                        CHECK(reassembler.feed(f, [&](MagicType connId, const char *chunk, size_t size, bool last)
+                                               { CHECK(connId == 5);
+                                                 got[messages].append(chunk, size);
+                                                 if (last)
+                                                     messages++; })); });
+            CHECK(messages == 2);
+            CHECK(got[0] == message && got[1] == message);
+            CHECK(frames == 2 * (Api::fragment_count(length) + 1));
+            close(fd);
+        }
+
+        // Too big is dropped from the chunk that crosses the limit on, the next message on the connection is fine again
+        Api::Reassembler reassembler;
+        reassembler.maxMessageSize = 1000;
+        std::string big = pattern(2 * max), small = pattern(10);
+        int fd = memfd_create("fragments", 0);
+        Api::Output output(fd);
+        output.writeMessage(5, big.data(), big.size());
+        output.writeMessage(5, small.data(), small.size());
+        output.flush();
+        std::string got;
+        decodeAll(fd, [&](const Api::frame &f)
+                  { reassembler.feed(f, [&](MagicType, const char *chunk, size_t size, bool)
+                                     { got.append(chunk, size); }); });
+        CHECK(reassembler.dropped == 1);
+        CHECK(got == small);
+        close(fd);
+    }
+
+    // Frames straddling the end of the decoder storage survive compaction
+    void decoder()
+    {
+        int fd = memfd_create("decoder", 0);
+        Api::Output output(fd);
+        std::string message = pattern(Api::MAX_MESSAGE_LENGTH);
+        size_t written = 0;
+        for (size_t i = 0; written < (size_t)Api::DECODER_SIZE * 3; i++)
+        {
+            size_t length = 1 + i * 7919 % Api::MAX_MESSAGE_LENGTH;
+            output.writeMessage(i % 200, message.data(), length);
+            written += length;
+        }
+        output.flush();
+        size_t read = 0, i = 0;
+        decodeAll(fd, [&](const Api::frame &f)
+                  { size_t length = 1 + i * 7919 % Api::MAX_MESSAGE_LENGTH;
+                    CHECK(f.magic == i % 200 && f.length == length && !memcmp(f.message, message.data(), length));
+                    read += f.length;
+                    i++; });
+        CHECK(read == written);
+        close(fd);
+    }
+
+    void chunks()
+    {
+        using Delta::ChunkChain;
+        using Delta::ChunkPool;
+        std::string data = pattern(ChunkChain::limit);
+        size_t pieces[] = {1, ChunkPool::CHUNK_SIZE - 2, 1, ChunkPool::CHUNK_SIZE + 5, 3 * ChunkPool::CHUNK_SIZE, 7};
+        ChunkChain chain;
+        size_t offset = 0;
+        for (size_t piece : pieces)
+        {
+            CHECK(chain.append(data.data() + offset, piece));
+            offset += piece;
+        }
+        CHECK(chain.size() == offset);
+        std::string got;
+        int count = 0;
+        chain.forEach([&](const char *chunk, size_t length)
+                      { CHECK(length <= ChunkPool::CHUNK_SIZE);
+                        got.append(chunk, length);
+                        count++; });
+        CHECK(got == data.substr(0, offset));
+        CHECK(count == (int)((offset + ChunkPool::CHUNK_SIZE - 1) / ChunkPool::CHUNK_SIZE)); // Every chunk but the last is full
+
+        // All or nothing at the per connection limit
+        CHECK(!chain.append(data.data(), ChunkChain::limit - offset + 1));
+        CHECK(chain.size() == offset);
+        CHECK(chain.append(data.data() + offset, ChunkChain::limit - offset));
+        chain.release();
+        CHECK(chain.size() == 0);
+
+        // And at the pool's cap, what a failed append took is given back
+        size_t cap = Delta::chunkPool.cap;
+        Delta::chunkPool.cap = 3 * ChunkPool::CHUNK_SIZE;
+        ChunkChain first, second;
+        CHECK(first.append(data.data(), ChunkPool::CHUNK_SIZE + 1));
+        CHECK(!second.append(data.data(), ChunkPool::CHUNK_SIZE + 1));
+        CHECK(second.append(data.data(), ChunkPool::CHUNK_SIZE));
+        CHECK(!second.append(data.data(), 1));
+        first.release();
+        CHECK(second.append(data.data(), 1));
+        second.release();
+        Delta::chunkPool.cap = cap;
+    }
+
+    void slots()
+    {
+        typedef Delta::SlotMap<int, 2> Map;
+        Map map;
+        int a = 1, b = 2, c = 3;
+        int freed = 0;
+        Map::Handle ha = map.insert(&a);
+        Map::Handle hb = map.insert(&b);
+        CHECK(map.insert(&c) == Map::INVALID_HANDLE); // Full
+        CHECK(map.get(ha) == &a && map.get(hb) == &b);
+        {
+            Delta::Epoch::Guard guard(map.epoch);
+            CHECK(map.remove(ha, [&](int *) { freed++; }));
+            CHECK(freed == 0); // A reader might still hold it
+        }
+        CHECK(!map.remove(ha, [&](int *) { freed++; })); // Stale
+        Map::Handle hc = map.insert(&c);
+        CHECK(Map::slotOf(hc) == Map::slotOf(ha) && hc != ha);
+        CHECK(map.get(ha) == nullptr);
+        CHECK(map.get(hc) == &c);
+        CHECK(map.at(Map::slotOf(ha)) == &c);
+        CHECK(map.remove(hb, [&](int *) { freed++; }));
+        CHECK(freed == 2); // No reader left, both go
+        CHECK(map.count == 1);
+    }
+
+    int main()
+    {
+        varint();
+        fragments();
+        decoder();
+        chunks();
+        slots();
+        printf("%s\n", failures ? "FAILED" : "OK");
+        return failures;
+    }
+}
+
+int main()
+{
+    return Test::main();
+}
@@ -0,0 +1,164 @@
+#include "log.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/* Api codec and framing benchmarks
+ *  Prints one JSON object per line so results can be diffed between releases:
+ *      {"bench":"encode","variant":"make_buffer","payload":64,"frames":100000,"ns_per_frame":12.3,"frames_per_sec":81300813}
+ *  --quick runs a fraction of the iterations (used by ctest), --varint switches the framing.
+ */
+
+namespace Bench
+{
+    const int PAYLOADS[] = {1, 16, 64, 256, 1024, 4096, 16384, Api::MAX_MESSAGE_LENGTH};
+    long scale = 1;
+    char payload[Api::MAX_MESSAGE_LENGTH];
+    volatile size_t sink; // Keeps the optimizer honest
+
+    long iterations(int size) { return std::max<long>(2000, (256L << 20) / (size + 64)) / scale; }
+
+    template <typename Func>
+    void run(const char *bench, const char *variant, int size, long frames, Func func)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func(frames);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"framing\":\"%s\",\"payload\":%d,\"frames\":%ld,\"ns_per_frame\":%.2f,\"frames_per_sec\":%.0f}\n",
+               bench, variant, Api::frameMode == Api::VARINT ? "varint" : "fixed", size, frames, ns / frames, frames / ns * 1e9);
+        fflush(stdout);
+    }
+
+    void encode(int size)
+    {
+        long n = iterations(size);
+        run("encode", "make_buffer", size, n, [size](long n)
+            { for (long i = 0; i < n; i++)
+              {
+                  Api::buffer *buffer = Api::make_buffer(1, payload, size);
+                  sink = sink + buffer->len;
+                  free(buffer->buf);
+                  free(buffer);
+              } });
+        run("encode", "encode_prefix", size, n, [size](long n)
+            { char prefix[Api::MAX_PREFIX_SIZE];
+              for (long i = 0; i < n; i++)
+                  sink = sink + Api::encode_prefix(prefix, 1, size); });
+        static char frame[Api::MAX_FULL_MESSAGE_SIZE + Api::MAX_PREFIX_SIZE];
+        run("encode", "encode", size, n, [size](long n)
+            { for (long i = 0; i < n; i++)
+                  sink = sink + Api::encode(frame, 1, payload, size); });
+    }
+
+    // Frames into /dev/null, so this is the syscall + copy cost without a reader
+    void write(int size)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        long n = iterations(size) / 4;
+        run("write", "buffer_write", size, n, [fd, size](long n)
+            { for (long i = 0; i < n; i++)
+                  sink = sink + Api::buffer_write(fd, Api::make_buffer(1, payload, size)); });
+        run("write", "frame_write", size, n, [fd, size](long n)
+            { for (long i = 0; i < n; i++)
+                  sink = sink + Api::frame_write(fd, 1, payload, size); });
+        Api::Output output(fd);
+        run("write", "output", size, n, [&output, size](long n)
+            { for (long i = 0; i < n; i++)
+                  sink = sink + output.writeMessage(1, payload, size);
+              output.flush(); });
+        close(fd);
+    }
+
+    // Api::log as the backend calls it, synchronous, into /dev/null
+    void log()
+    {
+        long n = 200000 / scale;
+        int fd = Api::out.fd;
+        Api::out.fd = open("/dev/null", O_WRONLY);
+        for (bool binary : {false, true})
+        {
+            Api::binaryLogs = binary;
+            run("log", binary ? "binary" : "text", 0, n, [](long n)
+                { for (long i = 0; i < n; i++)
+                      sink = sink + Api::log_info("Message from the Client {}:{} with {} bytes", "127.0.0.1", 8888, i);
+                  Api::out.flush(); });
+        }
+        Api::binaryLogs = false;
+        close(Api::out.fd);
+        Api::out.fd = fd;
+    }
+
+    // Frames of one size encoded into a memfd, then decoded the way serve() does it
+    void decode(int size)
+    {
+        long n = iterations(size) / 4;
+        int fd = memfd_create("bench", 0);
+        Api::Output output(fd);
+        output.flushDelay = std::chrono::microseconds(0);
+        for (long i = 0; i < n; i++)
+            output.writeMessage(1, payload, size);
+        run("decode", "decoder", size, n, [fd](long)
+            { lseek(fd, 0, SEEK_SET);
+              Api::Decoder decoder(fd, Api::OUTBOUND);
+              Api::frame frame;
+              while (decoder.fill() > 0)
+                  while (decoder.next(frame))
+                      sink = sink + frame.length; });
+        close(fd);
+    }
+
+    // Writer process -> pipe -> Decoder, the full eta <-> delta path
+    void roundtrip(int size)
+    {
+        long n = iterations(size) / 8;
+        run("roundtrip", "pipe", size, n, [size](long n)
+            { int p[2];
+              pipe(p);
+              pid_t pid = fork();
+              if (pid == 0)
+              {
+                  close(p[0]);
+                  Api::Output output(p[1]);
+                  for (long i = 0; i < n; i++)
+                      output.writeMessage(1, payload, size);
+                  output.flush();
+                  _exit(0);
+              }
+              close(p[1]);
+              Api::Decoder decoder(p[0], Api::OUTBOUND);
+              Api::frame frame;
+              while (decoder.fill() > 0)
+                  while (decoder.next(frame))
+                      sink = sink + frame.length;
+              close(p[0]);
+              waitpid(pid, nullptr, 0); });
+    }
+
+    int main(int argc, char **argv)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "--quick")
+                scale = 64;
+            else if (arg == "--varint")
+                Api::frameMode = Api::VARINT;
+        }
+        memset(payload, 'x', sizeof(payload));
+        for (int size : PAYLOADS)
+            encode(size);
+        for (int size : PAYLOADS)
+            write(size);
+        log();
+        for (int size : PAYLOADS)
+            decode(size);
+        for (int size : PAYLOADS)
+            roundtrip(size);
+        return 0;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    return Bench::main(argc, argv);
+}